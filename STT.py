@@ -10,6 +10,8 @@ import queue
 import time
 import socket
 import unicodedata
+import mmap
+import struct
 import warnings
 
 warnings.filterwarnings("ignore", category=UserWarning)
@@ -36,6 +38,12 @@ parser.add_argument('--cc_port', default=54001, type=int, help='cc_injector UDP
 parser.add_argument('--send_cc', default='True', type=str, help='send caption lines via UDP (True/False)')
 parser.add_argument('--print_chunks', default='True', type=str, help='print caption chunks to console (True/False)')
 parser.add_argument('--maxlen', default=32, type=int, help='max characters per caption line (CEA-608 cap is 32)')
+parser.add_argument('--tap', default='', type=str,
+                    help='read decoded program audio from the injector shm tap (e.g. /cc_tap) instead of a sound card')
+parser.add_argument('--heartbeat_ms', default=200, type=int,
+                    help='send "@hb=1" keepalives this often so a redundant injector can fail over quickly (0 = off)')
+parser.add_argument('--send_segments', default='True', type=str,
+                    help='send each transcript as one timed segment; the injector wraps it into rows (True/False)')
 args = parser.parse_args()
 
 # ------------------------------ Utils ------------------------------
@@ -48,6 +56,7 @@ def str2bool(string):
 
 SEND_CC = str2bool(args.send_cc)
 PRINT_CHUNKS = str2bool(args.print_chunks)
+SEND_SEGMENTS = str2bool(args.send_segments)
 
 def cea608_sanitize(s: str, limit: int = 32) -> str:
     """
@@ -124,11 +133,69 @@ def record_audio(out_queue, rate, seconds, channels):
             print(f"[record] error: {e}")
             time.sleep(0.5)
 
+# ------------------------------ Injector audio tap (shared memory) ------------------------------
+# Mirrors AudioTapHeader / AudioTapStamp in cc_injector.cpp
+TAP_HDR = struct.Struct('<8sIIIIQQ24x')
+TAP_STAMP = struct.Struct('<Qq')
+TAP_WRITE_POS_OFF = 24
+
+def tap_pts_at(mm, stamp_cap, stamp_pos, sample_pos, rate):
+    """
+    Input PTS (microseconds) of `sample_pos`, extrapolated from the newest stamp at or before it.
+    """
+    base = TAP_HDR.size
+    for k in range(min(stamp_pos, stamp_cap)):
+        off = base + ((stamp_pos - 1 - k) % stamp_cap) * TAP_STAMP.size
+        pos, pts_us = TAP_STAMP.unpack_from(mm, off)
+        if pos <= sample_pos:
+            return pts_us + (sample_pos - pos) * 1000000 // rate
+    return None
+
+def read_tap(out_queue, name, seconds):
+    """
+    Reads `seconds` of 16 kHz mono float PCM at a time from the injector tap and queues
+    (pcm, start_seconds, chunk_index) so captions can be timed to the exact program audio.
+    """
+    path = '/dev/shm/' + name.lstrip('/')
+    while not os.path.exists(path):
+        print(f"[tap] waiting for {path}")
+        time.sleep(1.0)
+    with open(path, 'rb') as f:
+        mm = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+    magic, _ver, rate, cap, stamp_cap, write_pos, _stamp_pos = TAP_HDR.unpack_from(mm, 0)
+    if not magic.startswith(b'CCTAP1'):
+        raise RuntimeError(f"{path} is not a cc_injector audio tap")
+    samples = np.frombuffer(mm, dtype=np.float32, count=cap, offset=TAP_HDR.size + stamp_cap * TAP_STAMP.size)
+    chunk = rate * seconds
+    # Chunks sit on a fixed grid of the tap's sample clock, so redundant STT instances reading the
+    # same injector transcribe identical audio and number their segments identically.
+    read_pos = (write_pos // chunk) * chunk
+    while True:
+        write_pos, stamp_pos = struct.unpack_from('<QQ', mm, TAP_WRITE_POS_OFF)
+        if write_pos - read_pos > cap:
+            read_pos = ((write_pos - chunk) // chunk) * chunk  # fell behind the ring: resync
+        if write_pos - read_pos < chunk:
+            time.sleep(0.05)
+            continue
+        idx = (np.arange(read_pos, read_pos + chunk, dtype=np.uint64) & np.uint64(cap - 1)).astype(np.int64)
+        pcm = samples[idx].copy()
+        # The injector keeps writing during the copy: if it lapped read_pos meanwhile, part of
+        # pcm is newer audio (torn chunk). Drop it and resync like above.
+        write_pos, stamp_pos = struct.unpack_from('<QQ', mm, TAP_WRITE_POS_OFF)
+        if write_pos - read_pos > cap:
+            read_pos = ((write_pos - chunk) // chunk) * chunk
+            continue
+        start_us = tap_pts_at(mm, stamp_cap, stamp_pos, read_pos, rate)
+        out_queue.put((pcm, None if start_us is None else start_us / 1e6, read_pos // chunk))
+        read_pos += chunk
+
 # ------------------------------ Processing + UDP send ------------------------------
-def process_audio(in_queue, model, task, rate, output_dir, cc_host, cc_port, maxlen):
+def process_audio(in_queue, model, task, rate, seconds, output_dir, cc_host, cc_port, maxlen):
     """
     Reads audio chunks from queue, writes WAV, runs Whisper, splits into <=32-char chunks,
-    prints (optional) and sends each chunk via UDP (optional).
+    prints (optional) and sends via UDP (optional): either the whole transcript as one
+    "@d=SECONDS text" segment that the injector spreads over the chunk duration, or
+    (legacy) each chunk as its own datagram.
     """
     audio_model = whisper.load_model(model)
     index = 0
@@ -147,10 +214,17 @@ def process_audio(in_queue, model, task, rate, output_dir, cc_host, cc_port, max
         audio_file_path = f"{output_dir}/audio{index}.wav"
 
         try:
-            wavfile.write(audio_file_path, rate=rate, data=recording)
+            # Tap chunks arrive as (16 kHz pcm, start seconds) and go to Whisper without a WAV round trip
+            tap_start = None
+            chunk_index = 0
+            if isinstance(recording, tuple):
+                audio_in, tap_start, chunk_index = recording
+            else:
+                wavfile.write(audio_file_path, rate=rate, data=recording)
+                audio_in = audio_file_path
 
             result = audio_model.transcribe(
-                audio_file_path,
+                audio_in,
                 task=task,
                 no_speech_threshold=0.6,
                 compression_ratio_threshold=2.0,
@@ -161,13 +235,37 @@ def process_audio(in_queue, model, task, rate, output_dir, cc_host, cc_port, max
 
             # Chunk and sanitize for 608
             chunks = chunk_text_for_captions(text, limit=maxlen)
+            if tap_start is not None and SEND_CC and sock is not None:
+                # Whisper segment times are relative to the chunk: send them on the stream timeline.
+                # seq is derived from the chunk grid so a redundant STT on the same tap dedupes against us.
+                for k, ws in enumerate((result or {}).get('segments', [])):
+                    seg = cea608_sanitize(ws.get('text', ''), limit=1024)
+                    if not seg:
+                        continue
+                    t0 = tap_start + float(ws.get('start', 0.0))
+                    t1 = tap_start + float(ws.get('end', 0.0))
+                    try:
+                        seq = chunk_index * 64 + min(k, 63)
+                        payload = (f"@seq={seq},t={t0:.3f}-{t1:.3f} " + seg + "\n").encode("ascii", "ignore")
+                        sock.sendto(payload, (cc_host, cc_port))
+                    except Exception as se:
+                        print(f"[cc] send error: {se}")
+            elif SEND_SEGMENTS and SEND_CC and sock is not None:
+                seg = " ".join(c for c in (cea608_sanitize(c, limit=maxlen) for c in chunks) if c)
+                if seg:
+                    try:
+                        # One datagram per transcript; injector wraps to 32 columns and paces rows
+                        payload = (f"@d={seconds:.2f} " + seg + "\n").encode("ascii", "ignore")
+                        sock.sendto(payload, (cc_host, cc_port))
+                    except Exception as se:
+                        print(f"[cc] send error: {se}")
             for c in chunks:
                 c608 = cea608_sanitize(c, limit=maxlen)
                 if not c608:
                     continue
                 if PRINT_CHUNKS:
                     print(c608)
-                if SEND_CC and sock is not None:
+                if SEND_CC and sock is not None and not SEND_SEGMENTS and tap_start is None:
                     try:
                         # One datagram per line; injector reads the last line
                         payload = (c608 + "\n").encode("ascii", "ignore")
@@ -180,6 +278,18 @@ def process_audio(in_queue, model, task, rate, output_dir, cc_host, cc_port, max
 
         index = (index + 1) % args.audiocounts
 
+def send_heartbeats(host, port, interval_ms):
+    """
+    Periodic "@hb=1" so the injector knows this source is alive even while nobody speaks.
+    """
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    while True:
+        try:
+            sock.sendto(b"@hb=1\n", (host, port))
+        except Exception as e:
+            print(f"[cc] heartbeat error: {e}")
+        time.sleep(interval_ms / 1000.0)
+
 def main():
     rate = args.rate
     seconds = args.audioseconds
@@ -191,15 +301,22 @@ def main():
     os.makedirs(output_dir, exist_ok=True)
 
     audio_queue = queue.Queue(maxsize=3)
-    recording_thread = threading.Thread(
-        target=record_audio, args=(audio_queue, rate, seconds, channels), daemon=True
-    )
+    if args.tap:
+        recording_thread = threading.Thread(
+            target=read_tap, args=(audio_queue, args.tap, seconds), daemon=True
+        )
+    else:
+        recording_thread = threading.Thread(
+            target=record_audio, args=(audio_queue, rate, seconds, channels), daemon=True
+        )
     processing_thread = threading.Thread(
-        target=process_audio, args=(audio_queue, model, task, rate, output_dir, args.cc_host, args.cc_port, args.maxlen), daemon=True
+        target=process_audio, args=(audio_queue, model, task, rate, seconds, output_dir, args.cc_host, args.cc_port, args.maxlen), daemon=True
     )
 
     recording_thread.start()
     processing_thread.start()
+    if SEND_CC and args.heartbeat_ms > 0:
+        threading.Thread(target=send_heartbeats, args=(args.cc_host, args.cc_port, args.heartbeat_ms), daemon=True).start()
 
     try:
         while True:
@@ -1,6 +1,6 @@
 
 // cc_injector.cpp
-// Build (Ubuntu): g++ -std=c++17 cc_injector.cpp $(pkg-config --cflags --libs libavformat libavcodec libavutil libswresample) -o cc_injector
+// Build (Ubuntu): g++ -std=c++17 -pthread cc_injector.cpp $(pkg-config --cflags --libs libavformat libavcodec libavutil libswresample libswscale libavfilter) -ldl -o cc_injector
 
 #include <iostream>
 #include <vector>
@@ -9,21 +9,53 @@
 #include <algorithm>
 #include <cctype>
 #include <cerrno>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdlib>
+#include <cstdio>
+#include <new>
+#include <cmath>
+#include <chrono>
+#include <ctime>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 // POSIX UDP socket (non-blocking)
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <dlfcn.h>
+
+#include "cc_plugin.h"
 
 extern "C" {
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
 #include <libavutil/opt.h>
 #include <libavutil/frame.h>
+#include <libavutil/time.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/samplefmt.h>
+#include <libavutil/pixdesc.h>
 #include <libavutil/channel_layout.h> // legacy + new API header
+#include <libswresample/swresample.h>
+#include <libswscale/swscale.h>
+#include <libavfilter/avfilter.h>
+#include <libavfilter/buffersrc.h>
+#include <libavfilter/buffersink.h>
 }
 
 // ======================================================================================
@@ -113,15 +145,37 @@ static void build_popon_cc(std::vector<uint8_t>& out, const std::string& line)
     push_pair(out, 0x14, 0x2F); // EOC
 }
 
+// State refresh for decoders that join mid-caption: RU2 always (a repeat is a no-op for a
+// decoder already in roll-up 2), then PAC + the bottom row. Nothing rolls, so viewers who
+// already have the row see it repainted in place.
+static void build_ru2_refresh(std::vector<uint8_t>& out, const std::string& line)
+{
+    out.clear();
+    push_pair(out, 0x14, 0x25); // RU2
+    uint8_t p1=0,p2=0; if (build_pac_for_row(15,p1,p2)) push_pair(out,p1,p2);
+    push_text(out, line);
+}
+
 // ======================================================================================
 // UDP caption input (non-blocking) + logging
 // ======================================================================================
 
+// Per-socket receive accounting. kernel_drops is the SO_RXQ_OVFL counter: datagrams the kernel
+// discarded because the receive buffer was full (cumulative, carried on every datagram).
+struct RxStats {
+    uint64_t datagrams = 0, bytes = 0;
+    uint64_t rejects = 0;        // lines that did not parse into a caption
+    uint64_t truncated = 0;      // datagrams larger than the receive buffer
+    uint32_t kernel_drops = 0;
+};
+
 struct CaptionInput {
     int fd = -1;                 // UDP socket
     std::string host;
     uint16_t port = 0;
     bool enabled = false;
+    RxStats stats;
+    std::string label;           // "udp://host:port", built once for per-poll logging
 };
 
 static bool set_nonblock(int fd) {
@@ -130,11 +184,59 @@ static bool set_nonblock(int fd) {
     return (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0);
 }
 
+// Size the receive buffer (0 = kernel default) and turn on kernel drop reporting.
+static void enable_rx_accounting(int fd, int rcvbuf_bytes, const std::string& label) {
+    if (rcvbuf_bytes > 0 && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf_bytes, sizeof(rcvbuf_bytes)) != 0)
+        std::cerr << "[cc] " << label << ": SO_RCVBUF " << rcvbuf_bytes << " failed: " << std::strerror(errno) << "\n";
+#ifdef SO_RXQ_OVFL
+    int one = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one)) != 0)
+        std::cerr << "[cc] " << label << ": SO_RXQ_OVFL unavailable; kernel drops will not be counted\n";
+#endif
+    int eff = 0; socklen_t elen = sizeof(eff);
+    if (rcvbuf_bytes > 0 && getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &eff, &elen) == 0 && eff < rcvbuf_bytes)
+        std::cerr << "[cc] " << label << ": receive buffer capped at " << eff << " bytes (raise net.core.rmem_max)\n";
+}
+
+// recvmsg() one datagram, updating byte/datagram/truncation counts and the kernel drop counter.
+// Logs whenever the kernel reports new drops.
+static ssize_t recv_counted(int fd, char* buf, size_t cap, int flags, RxStats& st, const std::string& label) {
+    iovec iov{buf, cap};
+    alignas(cmsghdr) char ctrl[CMSG_SPACE(sizeof(uint32_t))];
+    msghdr msg{};
+    msg.msg_iov = &iov; msg.msg_iovlen = 1;
+    msg.msg_control = ctrl; msg.msg_controllen = sizeof(ctrl);
+    ssize_t n = recvmsg(fd, &msg, flags);
+    if (n < 0) return n;
+
+    ++st.datagrams;
+    st.bytes += (uint64_t)n;
+    if (msg.msg_flags & MSG_TRUNC) ++st.truncated;
+#ifdef SO_RXQ_OVFL
+    for (cmsghdr* c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SO_RXQ_OVFL) continue;
+        uint32_t drops = 0; std::memcpy(&drops, CMSG_DATA(c), sizeof(drops));
+        if (drops != st.kernel_drops)
+            std::cerr << "[cc] " << label << ": kernel dropped " << (drops - st.kernel_drops)
+                      << " datagram(s) (total " << drops << "); raise --cc-rcvbuf\n";
+        st.kernel_drops = drops;
+    }
+#endif
+    return n;
+}
+
+static void log_rx_stats(const std::string& label, const RxStats& st) {
+    std::cerr << "[cc] " << label << ": datagrams=" << st.datagrams << " bytes=" << st.bytes
+              << " kernel_drops=" << st.kernel_drops << " truncated=" << st.truncated
+              << " rejects=" << st.rejects << "\n";
+}
+
 // Bind udp://host:port; empty host → 127.0.0.1
-static bool open_udp_listener(CaptionInput& ci, const std::string& host, uint16_t port) {
+static bool open_udp_listener(CaptionInput& ci, const std::string& host, uint16_t port, int rcvbuf_bytes = 0) {
     ci.fd = socket(AF_INET, SOCK_DGRAM, 0);
     if (ci.fd < 0) return false;
     int reuse=1; setsockopt(ci.fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    enable_rx_accounting(ci.fd, rcvbuf_bytes, "udp://" + host + ":" + std::to_string(port));
 
     sockaddr_in addr{}; addr.sin_family = AF_INET;
     addr.sin_port = htons(port);
@@ -145,6 +247,7 @@ static bool open_udp_listener(CaptionInput& ci, const std::string& host, uint16_
     if (!set_nonblock(ci.fd)) { close(ci.fd); ci.fd=-1; return false; }
 
     ci.host = h; ci.port = port; ci.enabled = true;
+    ci.label = "udp://" + ci.host + ":" + std::to_string(ci.port);
     std::cerr << "[cc] Listening for captions on udp://" << ci.host << ":" << ci.port << "\n";
     return true;
 }
@@ -163,53 +266,892 @@ static inline void trim_inplace(std::string& s) {
     ltrim_inplace(s); rtrim_inplace(s);
 }
 
-// Drain UDP and return the last non-empty line (sanitized, <=32 chars). Logs each final line.
-static bool udp_get_latest_line_and_log(int fd, std::string& out_line) {
-    if (fd < 0) return false;
+// Sanitize to printable ASCII (tab -> space, stop at other controls), clamp, trim.
+static std::string sanitize_caption_text(const std::string& in, size_t limit) {
+    std::string t; t.reserve(std::min(in.size(), limit));
+    for (char c : in) {
+        unsigned char uc = (unsigned char)c;
+        if (uc >= 0x20 && uc <= 0x7E) t.push_back((char)uc);
+        else if (uc == '\t') t.push_back(' ');
+        else break; // stop at control
+        if (t.size() >= limit) break;
+    }
+    trim_inplace(t);
+    return t;
+}
+
+// One transcript segment as received from a caption source.
+//   plain text            -> untimed segment, rows spread at --seg_row_ms
+//   @t=START-END text     -> rows spread across [START,END) (seconds, stream timeline)
+//   @t=START text         -> starts at START, rows spread at --seg_row_ms
+//   @d=DUR text           -> starts on arrival, rows spread across DUR seconds
+//   @ch=ID,... text       -> channel tag (multicast ingest routes on it)
+//   @seq=N,... text       -> sequence number; redundant sources are deduplicated on it
+//   @hb=1                 -> heartbeat (no text), keeps a source "alive" for failover
+//   @pri=P,... text       -> lane: 0/emergency, 1/operator, 2/normal (default)
+// Keys combine with commas (e.g. "@ch=12,t=4.0-6.5 text"). Unknown @keys are ignored so senders can add fields without breaking older injectors.
+struct CaptionSegment {
+    std::string text;
+    double start_s = -1.0;   // <0: on arrival
+    double end_s   = -1.0;   // <0: derive from row count
+    double dur_s   = -1.0;   // relative duration (d=)
+    int    channel = -1;     // ch= (-1: untagged)
+    int64_t seq    = -1;     // seq= (-1: unsequenced)
+    bool heartbeat = false;  // hb=1
+    int priority   = 2;      // pri= (LANE_NORMAL)
+};
+
+static bool parse_caption_segment(const std::string& line, CaptionSegment& seg) {
+    seg = CaptionSegment{};
+    std::string body = line;
+    if (!body.empty() && body[0] == '@') {
+        size_t sp = body.find(' ');
+        std::string hdr = body.substr(1, sp == std::string::npos ? std::string::npos : sp - 1);
+        body = (sp == std::string::npos) ? std::string() : body.substr(sp + 1);
+
+        size_t start = 0;
+        while (start <= hdr.size()) {
+            size_t comma = hdr.find(',', start);
+            std::string kv = hdr.substr(start, comma == std::string::npos ? std::string::npos : comma - start);
+            size_t eq = kv.find('=');
+            if (eq != std::string::npos) {
+                std::string k = kv.substr(0, eq), v = kv.substr(eq + 1);
+                if (k == "t") {
+                    size_t dash = v.find('-', 1);
+                    seg.start_s = std::atof(v.substr(0, dash).c_str());
+                    if (dash != std::string::npos) seg.end_s = std::atof(v.substr(dash + 1).c_str());
+                } else if (k == "d") {
+                    seg.dur_s = std::atof(v.c_str());
+                } else if (k == "ch") {
+                    seg.channel = std::atoi(v.c_str());
+                } else if (k == "seq") {
+                    seg.seq = std::atoll(v.c_str());
+                } else if (k == "hb") {
+                    seg.heartbeat = (v != "0");
+                } else if (k == "pri") {
+                    if (v == "emergency")     seg.priority = 0;
+                    else if (v == "operator") seg.priority = 1;
+                    else if (v == "normal")   seg.priority = 2;
+                    else                      seg.priority = std::min(std::max(std::atoi(v.c_str()), 0), 2);
+                }
+            }
+            if (comma == std::string::npos) break;
+            start = comma + 1;
+        }
+    }
+    seg.text = sanitize_caption_text(body, 1024);
+    return !seg.text.empty() || seg.heartbeat;
+}
+
+// Normalize CR->LF, split a datagram by LF and append every non-empty line as a segment.
+// Non-empty lines that yield nothing (e.g. only control bytes) are counted in *rejects.
+static size_t split_datagram_segments(const char* buf, size_t n, std::vector<CaptionSegment>& out, uint64_t* rejects = nullptr) {
+    std::string s(buf, n);
+    for (char& ch : s) if (ch == '\r') ch = '\n';
+    size_t count = 0, start = 0;
+    while (true) {
+        size_t pos = s.find('\n', start);
+        std::string line = (pos == std::string::npos) ? s.substr(start) : s.substr(start, pos - start);
+        CaptionSegment seg;
+        if (!line.empty()) {
+            if (parse_caption_segment(line, seg)) {
+                out.push_back(std::move(seg));
+                ++count;
+            } else if (rejects) {
+                ++*rejects;
+            }
+        }
+        if (pos == std::string::npos) break;
+        start = pos + 1;
+    }
+    return count;
+}
+
+// Drain UDP and return every non-empty line as a segment (nothing is dropped). Logs each line.
+static bool udp_drain_segments_and_log(CaptionInput& ci, std::vector<CaptionSegment>& out) {
+    if (ci.fd < 0) return false;
     bool got = false;
     char buf[2048];
     for (;;) {
-        sockaddr_in src{}; socklen_t slen = sizeof(src);
-        ssize_t n = recvfrom(fd, buf, sizeof(buf)-1, 0, (sockaddr*)&src, &slen);
+        ssize_t n = recv_counted(ci.fd, buf, sizeof(buf), 0, ci.stats, ci.label);
         if (n < 0) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) break;
             else break;
         }
-        buf[n] = '\0';
-        std::string s(buf, (size_t)n);
+        size_t first = out.size();
+        if (split_datagram_segments(buf, (size_t)n, out, &ci.stats.rejects)) got = true;
+        for (size_t k = first; k < out.size(); ++k)
+            if (!out[k].heartbeat) std::cerr << "[cc] recv: \"" << out[k].text << "\"\n";
+    }
+    return got;
+}
+
+// ======================================================================================
+// Redundant caption sources (primary/backup, sequence dedupe, failover)
+// ======================================================================================
+//
+// Sources are ranked: every --cc-udp (primary) ahead of every --cc-udp-backup, in CLI order.
+// The active source is the highest-ranked one heard (text or @hb=1) within --cc-failover_ms;
+// the choice is re-evaluated on every frame, so a silent primary is replaced on the next frame.
+//   - sequenced segments are taken from any source and deduplicated in a sliding window, so
+//     two STT instances sending the same seq air once and either can fill the other's gaps;
+//   - unsequenced segments air only from the active source. Standby sources hold the last
+//     failover window of theirs, which is flushed on takeover so nothing said during the
+//     silence detection is lost.
+
+// Sliding-window duplicate filter: O(1) per check (bit clears on advance are amortized).
+struct SeqWindow {
+    static const uint64_t SIZE = 1024;
+    bool any = false;
+    uint64_t top = 0;
+    uint64_t bits[SIZE / 64]{};
+
+    bool test(uint64_t s) const { return (bits[(s % SIZE) >> 6] >> (s & 63)) & 1; }
+    void set(uint64_t s)        { bits[(s % SIZE) >> 6] |=  (1ull << (s & 63)); }
+    void clr(uint64_t s)        { bits[(s % SIZE) >> 6] &= ~(1ull << (s & 63)); }
+
+    // true if `s` has not been seen before (and records it)
+    bool accept(uint64_t s) {
+        if (!any || (s < top && top - s >= SIZE)) {
+            // first message, or far behind the window: the sender restarted its numbering
+            if (any) std::cerr << "[cc] seq restart " << top << " -> " << s << "\n";
+            std::memset(bits, 0, sizeof(bits));
+            any = true; top = s; set(s);
+            return true;
+        }
+        if (s > top) {
+            if (s - top >= SIZE) std::memset(bits, 0, sizeof(bits));
+            else for (uint64_t k = top + 1; k < s; ++k) clr(k);
+            top = s; set(s);
+            return true;
+        }
+        if (test(s)) return false;
+        set(s);
+        return true;
+    }
+};
+
+struct CaptionSource {
+    CaptionInput in;
+    bool backup = false;
+    int64_t last_rx_us = 0;                                  // 0: never heard
+    std::deque<std::pair<int64_t, CaptionSegment>> held;     // standby: recent unsequenced segments
+    uint64_t aired = 0, dupes = 0;
+};
+
+struct RedundantInputs {
+    std::vector<CaptionSource> sources;                      // ranked
+    int active = 0;
+    int64_t failover_us = 500000;
+    SeqWindow window;
+    std::vector<CaptionSegment> tmp;
+};
+
+static inline bool cc_source_alive(const RedundantInputs& ri, const CaptionSource& src, int64_t now_us) {
+    return src.last_rx_us != 0 && now_us - src.last_rx_us <= ri.failover_us;
+}
+
+static void redundant_deliver(RedundantInputs& ri, CaptionSource& src, CaptionSegment&& seg, std::vector<CaptionSegment>& out) {
+    if (seg.seq >= 0 && !ri.window.accept((uint64_t)seg.seq)) { ++src.dupes; return; }
+    ++src.aired;
+    out.push_back(std::move(seg));
+}
+
+// Poll every source once (per frame) and return the segments that should air.
+static void redundant_poll(RedundantInputs& ri, int64_t now_us, std::vector<CaptionSegment>& out) {
+    for (size_t i = 0; i < ri.sources.size(); ++i) {
+        CaptionSource& src = ri.sources[i];
+        ri.tmp.clear();
+        if (!udp_drain_segments_and_log(src.in, ri.tmp)) continue;
+        src.last_rx_us = now_us;
+        for (CaptionSegment& seg : ri.tmp) {
+            if (seg.heartbeat && seg.text.empty()) continue;
+            if (seg.seq >= 0 || (int)i == ri.active) {
+                redundant_deliver(ri, src, std::move(seg), out);
+            } else {
+                src.held.emplace_back(now_us, std::move(seg));
+            }
+        }
+    }
+
+    // Highest-ranked live source wins; keep the current one if nobody is live
+    int want = ri.active;
+    for (size_t i = 0; i < ri.sources.size(); ++i) {
+        if (cc_source_alive(ri, ri.sources[i], now_us)) { want = (int)i; break; }
+    }
+    if (want != ri.active) {
+        CaptionSource& to = ri.sources[want];
+        std::cerr << "[cc] failover: " << ri.sources[ri.active].in.host << ":" << ri.sources[ri.active].in.port
+                  << " -> " << to.in.host << ":" << to.in.port << (to.backup ? " (backup)" : " (primary)")
+                  << " held=" << to.held.size() << "\n";
+        ri.active = want;
+        for (auto& h : to.held) redundant_deliver(ri, to, std::move(h.second), out);
+        to.held.clear();
+    }
+
+    for (CaptionSource& src : ri.sources) {
+        while (!src.held.empty() && now_us - src.held.front().first > ri.failover_us) src.held.pop_front();
+    }
+}
+
+// ======================================================================================
+// Transcript segmentation + caption scheduler (rows paced at the 608 field-1 rate)
+// ======================================================================================
+
+// Word-boundary wrap into rows of <= cols characters; words longer than a row are hard-split.
+static void segment_caption_rows(const std::string& text, size_t cols, std::vector<std::string>& rows) {
+    rows.clear();
+    std::string current;
+    size_t i = 0;
+    while (i < text.size()) {
+        while (i < text.size() && text[i] == ' ') ++i;
+        size_t j = i;
+        while (j < text.size() && text[j] != ' ') ++j;
+        if (j == i) break;
+        std::string w = text.substr(i, j - i);
+        i = j;
+
+        size_t need = current.empty() ? w.size() : current.size() + 1 + w.size();
+        if (need <= cols) {
+            if (!current.empty()) current.push_back(' ');
+            current += w;
+            continue;
+        }
+        if (!current.empty()) { rows.push_back(current); current.clear(); }
+        while (w.size() > cols) { rows.push_back(w.substr(0, cols)); w.erase(0, cols); }
+        current = w;
+    }
+    if (!current.empty()) rows.push_back(current);
+}
+
+// One caption row waiting for its release time (encoder time base).
+struct CaptionRow {
+    std::string text;
+    int64_t release_pts = 0;
+    int64_t linger      = 0;   // repaint window after release (encoder ticks)
+    int64_t due_frame   = -1;  // frame on which release_pts was first reached
+};
+
+// Priority lanes: a lower index preempts a higher one at the next legal point (see below).
+enum CaptionLane { LANE_EMERGENCY = 0, LANE_OPERATOR = 1, LANE_NORMAL = 2, CC_LANES = 3 };
+
+// One picture's cc_data. A/53 cc_count is 5 bits, so a picture never carries more than 31
+// triplets; the frame loop reuses a single instance instead of growing a vector per frame.
+static const size_t CC_DATA_MAX = 31 * 3;
+
+struct CcData {
+    uint8_t bytes[CC_DATA_MAX];
+    size_t size = 0;
+};
+
+struct CaptionLaneState {
+    std::deque<CaptionRow> rows; // sorted by release_pts
+    std::vector<uint8_t> air;    // triplets of the row on air (rebuilt in place, capacity kept)
+    size_t air_pos = 0;
+    CaptionRow on_air;           // requeued whole if preempted (empty text: linger repaint)
+    size_t text_begin = 0;       // air offset of the first text pair: preemptible up to here
+    size_t roll_end = 0;         // air offset just past the CR (0: the row does not roll)
+    std::string undo_prev, undo_curr;   // display state before this row, restored on preemption
+    bool undo_started = false;
+    bool erase = false;          // air is the silence EDM (on_air.text empty)
+    bool refresh = false;        // air is the GOP refresh riding the linger repaint
+};
+
+// Each lane releases rows at their target PTS and puts one row at a time "on air" as cc_data
+// triplets. Triplets drain at the CEA-608 field-1 rate (2 bytes per 1/29.97 s), so a long
+// segment never floods one frame. Every pair slot goes to the highest-priority lane with work,
+// but a lower lane is only cut off at a legal point: before its row's text starts. A row whose
+// text has begun finishes first (at most 16 pairs, about half a second), so the viewer never
+// sees a truncated line and then the whole line again. A row cut off before its text is
+// requeued whole and the display state it assumed is rolled back; if its CR already aired, the
+// blank bottom row it left is filled by the next row without another roll. A linger repaint or a
+// silence erase cut off before its first pair leaves the display as it was, so its state change
+// is rolled back too; the erase runs again once the lanes are idle.
+struct CaptionScheduler {
+    bool use_rollup = true;
+    RollUp2State ru2{};
+    std::string prev_row;        // top line (previous)
+    std::string curr_row;        // bottom line (current)
+
+    CaptionLaneState lanes[CC_LANES];
+
+    double pairs_per_frame = 1.0;
+    double credit = 0.0;
+    int64_t frame = 0;
+
+    int64_t linger_expire_pts = AV_NOPTS_VALUE;
+    int64_t last_row_pts = AV_NOPTS_VALUE;   // when the current bottom row went on air
+    uint64_t erasures = 0;
+    uint64_t segments = 0;       // pushed segments (each allocates its rows)
+    AVRational tb{1,1};          // encoder time base (PTS units)
+    int64_t row_ticks = 1;       // default spacing for untimed segments
+
+    // Preemption accounting (latency = frames from a priority row falling due to its first pair)
+    uint64_t preempted_rows = 0;
+    uint64_t priority_rows = 0;
+    int64_t priority_latency_sum = 0, priority_latency_max = 0;
+
+    // GOP-aligned state refresh (mode + PAC + bottom row), sent only in otherwise idle slots
+    std::vector<uint8_t> refresh;
+    size_t refresh_pos = 0;
+    uint64_t refresh_requests = 0, refresh_sent = 0, refresh_cut = 0;
+};
+
+static inline int64_t cc_sched_sec_to_pts(const CaptionScheduler& cs, double sec) {
+    return av_rescale_q((int64_t)(sec * AV_TIME_BASE), AVRational{1, AV_TIME_BASE}, cs.tb);
+}
+
+static void cc_sched_init(CaptionScheduler& cs, AVRational enc_tb, AVRational frame_rate, int seg_row_ms) {
+    cs.tb = enc_tb;
+    cs.row_ticks     = std::max<int64_t>(1, av_rescale_q(seg_row_ms, AVRational{1,1000}, enc_tb));
+    // 608 field 1 carries one byte pair per 1/29.97 s regardless of the video frame rate
+    double fps = frame_rate.num && frame_rate.den ? av_q2d(frame_rate) : 30000.0 / 1001.0;
+    cs.pairs_per_frame = (30000.0 / 1001.0) / fps;
+}
+
+static inline bool cc_lane_on_air(const CaptionLaneState& ln) { return ln.air_pos < ln.air.size(); }
+
+static inline bool cc_sched_refresh_pending(const CaptionScheduler& cs) {
+    return cs.refresh_pos < cs.refresh.size();
+}
+
+static inline bool cc_sched_idle(const CaptionScheduler& cs) {
+    for (const CaptionLaneState& ln : cs.lanes) if (cc_lane_on_air(ln)) return false;
+    return true;
+}
+
+// Spread a segment's rows across its duration. Rows scheduled faster than 608 can carry them
+// simply go out back to back.
+static void cc_sched_push_segment(CaptionScheduler& cs, const CaptionSegment& seg, int64_t now_pts, int64_t linger) {
+    ++cs.segments;
+    std::vector<std::string> rows;
+    segment_caption_rows(seg.text, 32, rows);
+    if (rows.empty()) return;
+    CaptionLaneState& ln = cs.lanes[std::min(std::max(seg.priority, 0), (int)LANE_NORMAL)];
+
+    int64_t start = now_pts;
+    if (seg.start_s >= 0) start = std::max<int64_t>(now_pts, cc_sched_sec_to_pts(cs, seg.start_s));
+
+    int64_t span = (int64_t)rows.size() * cs.row_ticks;
+    if (seg.start_s >= 0 && seg.end_s > seg.start_s)
+        span = cc_sched_sec_to_pts(cs, seg.end_s) - start;
+    else if (seg.dur_s > 0)
+        span = cc_sched_sec_to_pts(cs, seg.dur_s);
+    span = std::max<int64_t>(span, 0);
+
+    // Never release ahead of rows already waiting in the same lane
+    if (!ln.rows.empty()) start = std::max(start, ln.rows.back().release_pts);
+
+    for (size_t k = 0; k < rows.size(); ++k) {
+        CaptionRow r;
+        r.text = rows[k];
+        r.release_pts = start + (int64_t)(span * (int64_t)k / (int64_t)rows.size());
+        r.linger = linger;
+        ln.rows.push_back(std::move(r));
+    }
+    std::cerr << "[cc] segment: " << rows.size() << " row(s) over "
+              << span * av_q2d(cs.tb) << "s from pts=" << start
+              << (seg.priority < LANE_NORMAL ? (seg.priority == LANE_EMERGENCY ? " [emergency]" : " [operator]") : "") << "\n";
+}
+
+// Distinct-roll logic: roll only when the row differs from the bottom line, else repaint.
+// Builds straight into the lane's air buffer and moves the row into on_air, so a row start
+// reuses existing storage instead of allocating.
+static void cc_sched_start_row(CaptionScheduler& cs, CaptionLaneState& ln, CaptionRow&& r, int64_t pts) {
+    std::vector<uint8_t>& cc = ln.air;
+    bool roll = false;
+    ln.undo_prev = cs.prev_row;
+    ln.undo_curr = cs.curr_row;
+    ln.undo_started = cs.ru2.started;
+    ln.erase = ln.refresh = false;
+    if (!cs.use_rollup) {
+        build_popon_cc(cc, r.text);
+        cs.curr_row = r.text;
+    } else if (cs.curr_row.empty()) {
+        cs.curr_row = r.text;                             // first row, or a blank bottom row
+        build_ru2_repaint_no_roll(cc, cs.ru2, r.text);    // RU2 (once) + PAC + text
+    } else if (r.text != cs.curr_row) {
+        cs.prev_row = cs.curr_row;                        // becomes top after CR
+        cs.curr_row = r.text;                             // becomes bottom after CR
+        build_ru2_update_cc(cc, cs.ru2, r.text);          // includes CR
+        roll = true;
+    } else {
+        build_ru2_repaint_no_roll(cc, cs.ru2, r.text);    // same text: repaint only
+    }
+
+    ln.air_pos = 0;
+    // Text pairs sit at the end, followed only by EOC in pop-on mode; a roll's CR is pair 2
+    ln.text_begin = cc.size() - (cs.use_rollup ? 0 : 3) - 3 * ((std::min<size_t>(r.text.size(), 32) + 1) / 2);
+    ln.roll_end = roll ? 6 : 0;
+    if (cc_sched_refresh_pending(cs)) {         // the new row carries fresh state itself
+        if (cs.refresh_pos) ++cs.refresh_cut;
+        cs.refresh.clear(); cs.refresh_pos = 0;
+    }
+    cs.linger_expire_pts = pts + r.linger;
+    cs.last_row_pts = pts;
+    std::cerr << "[cc] row " << (roll ? "(roll)" : "(repaint)") << " pts=" << pts
+              << " \"" << r.text << "\"\n";
+    ln.on_air = std::move(r);
+}
+
+// A lane whose row text has started keeps the slot until the row is complete.
+static inline bool cc_lane_locked(const CaptionLaneState& ln) {
+    return cc_lane_on_air(ln) && ln.air_pos > ln.text_begin;
+}
+
+// Lane that gets the next pair slot: one that is mid-text, else the highest-priority lane that
+// is mid-row or has a due row; -1 if none.
+static int cc_sched_pick_lane(const CaptionScheduler& cs, int64_t pts) {
+    for (int l = 0; l < CC_LANES; ++l) if (cc_lane_locked(cs.lanes[l])) return l;
+    for (int l = 0; l < CC_LANES; ++l) {
+        const CaptionLaneState& ln = cs.lanes[l];
+        if (cc_lane_on_air(ln) || (!ln.rows.empty() && ln.rows.front().release_pts <= pts)) return l;
+    }
+    return -1;
+}
+
+// Queue a state refresh at a GOP start (IDR or intra-refresh recovery point). A decoder that
+// tunes in there has missed the RU2 and PAC that opened the current caption and shows nothing
+// until the next row; the refresh gives it mode, position and the bottom row within the GOP.
+// It never takes a pair slot from a lane: it drains only when every lane is idle, rides the
+// linger repaint if one is running, and is dropped once a new row starts.
+static void cc_sched_request_refresh(CaptionScheduler& cs) {
+    if (cs.curr_row.empty()) return;           // nothing displayed (or just erased)
+    if (cc_sched_refresh_pending(cs) && cs.refresh_pos) ++cs.refresh_cut;
+    if (cs.use_rollup) build_ru2_refresh(cs.refresh, cs.curr_row);
+    else               build_popon_cc(cs.refresh, cs.curr_row);
+    cs.refresh_pos = 0;
+    ++cs.refresh_requests;
+}
+
+// Produce this frame's cc_data (possibly empty) within the 608 budget.
+static void cc_sched_build_frame(CaptionScheduler& cs, int64_t pts, CcData& out) {
+    out.size = 0;
+    ++cs.frame;
+
+    for (CaptionLaneState& ln : cs.lanes) {
+        if (!ln.rows.empty() && ln.rows.front().release_pts <= pts && ln.rows.front().due_frame < 0)
+            ln.rows.front().due_frame = cs.frame;
+    }
+
+    // Linger window: keep repainting the bottom line while nothing else is on air or due
+    if (cc_sched_pick_lane(cs, pts) < 0 && !cs.curr_row.empty() &&
+        cs.linger_expire_pts != AV_NOPTS_VALUE && pts < cs.linger_expire_pts) {
+        CaptionLaneState& ln = cs.lanes[LANE_NORMAL];
+        ln.air.clear();
+        ln.undo_started = cs.ru2.started;
+        ln.erase = false;
+        ln.refresh = cc_sched_refresh_pending(cs) && cs.refresh_pos == 0;
+        if (ln.refresh) {
+            ln.air.insert(ln.air.end(), cs.refresh.begin(), cs.refresh.end());  // repaint with RU2
+            cs.refresh.clear();
+            ++cs.refresh_sent;
+        } else if (cs.use_rollup) build_ru2_repaint_no_roll(ln.air, cs.ru2, cs.curr_row);
+        else                      build_popon_cc(ln.air, cs.curr_row);
+        ln.air_pos = 0;
+        ln.text_begin = ln.air.size();          // a repaint may be cut anywhere
+        ln.on_air = CaptionRow{};
+    }
+
+    // Carry the fractional remainder so the average matches the field-1 rate at any frame rate
+    // (25p: two pairs every sixth frame); the cap only bounds the burst after idle frames
+    cs.credit = std::min(cs.credit + cs.pairs_per_frame, cs.pairs_per_frame + 1.0);
+    while (cs.credit >= 1.0) {
+        int l = cc_sched_pick_lane(cs, pts);
+        if (l < 0) break;
+        CaptionLaneState& ln = cs.lanes[l];
+
+        // Preempt lower lanes still before their text: requeue the row whole and undo the
+        // display state it assumed (a CR that already aired leaves a blank bottom row). An erase
+        // or repaint with nothing aired yet is undone; once its first pair (EDM, RU2 or PAC) is
+        // out, the decoder has already taken the state it assumed.
+        for (int m = l + 1; m < CC_LANES; ++m) {
+            CaptionLaneState& low = cs.lanes[m];
+            if (!cc_lane_on_air(low)) continue;
+            if (!low.on_air.text.empty()) {
+                if (low.roll_end && low.air_pos >= low.roll_end) {
+                    cs.prev_row = low.undo_curr;
+                    cs.curr_row.clear();
+                } else {
+                    cs.prev_row = low.undo_prev;
+                    cs.curr_row = low.undo_curr;
+                    cs.ru2.started = low.undo_started;
+                }
+                low.on_air.due_frame = cs.frame;
+                low.rows.push_front(low.on_air);
+                ++cs.preempted_rows;
+            } else if (low.air_pos == 0) {
+                if (low.erase) {
+                    cs.prev_row = low.undo_prev;
+                    cs.curr_row = low.undo_curr;
+                    --cs.erasures;
+                }
+                cs.ru2.started = low.undo_started;
+            }
+            if (low.refresh) { --cs.refresh_sent; ++cs.refresh_cut; }
+            low.erase = low.refresh = false;
+            low.air.clear(); low.air_pos = 0;
+            std::cerr << "[cc] preempt lane " << m << " by lane " << l << " frame=" << cs.frame << "\n";
+        }
+
+        if (!cc_lane_on_air(ln)) {
+            CaptionRow r = std::move(ln.rows.front());
+            ln.rows.pop_front();
+            if (l < LANE_NORMAL) {
+                int64_t lat = cs.frame - (r.due_frame < 0 ? cs.frame : r.due_frame);
+                ++cs.priority_rows;
+                cs.priority_latency_sum += lat;
+                cs.priority_latency_max = std::max(cs.priority_latency_max, lat);
+                std::cerr << "[cc] lane " << l << " on air after " << lat << " frame(s)\n";
+            }
+            cc_sched_start_row(cs, ln, std::move(r), pts);
+        }
+
+        if (out.size + 3 > CC_DATA_MAX) break;
+        std::memcpy(out.bytes + out.size, ln.air.data() + ln.air_pos, 3);
+        out.size += 3;
+        ln.air_pos += 3;
+        cs.credit -= 1.0;
+    }
+
+    // Spare slots: nothing on air or due, so the refresh cannot delay a caption
+    while (cs.credit >= 1.0 && cc_sched_refresh_pending(cs) && out.size + 3 <= CC_DATA_MAX) {
+        std::memcpy(out.bytes + out.size, cs.refresh.data() + cs.refresh_pos, 3);
+        out.size += 3;
+        cs.refresh_pos += 3;
+        cs.credit -= 1.0;
+        if (!cc_sched_refresh_pending(cs)) { cs.refresh.clear(); cs.refresh_pos = 0; ++cs.refresh_sent; }
+    }
+}
+
+// Erase displayed memory once nothing is on air or due and the last row has been up for at least
+// hold ticks. The next row starts a fresh roll-up (RU2 + PAC, no CR).
+static bool cc_sched_erase_if_idle(CaptionScheduler& cs, int64_t pts, int64_t hold) {
+    if (cs.curr_row.empty() || cc_sched_pick_lane(cs, pts) >= 0) return false;
+    if (cs.last_row_pts != AV_NOPTS_VALUE && pts - cs.last_row_pts < hold) return false;
+    CaptionLaneState& ln = cs.lanes[LANE_NORMAL];
+    ln.undo_prev = cs.prev_row;
+    ln.undo_curr = cs.curr_row;
+    ln.undo_started = cs.ru2.started;
+    ln.erase = true;
+    ln.refresh = false;
+    ln.air.clear();
+    push_pair(ln.air, 0x14, 0x2C);     // EDM, sent twice like other 608 control codes
+    push_pair(ln.air, 0x14, 0x2C);
+    ln.air_pos = 0;
+    ln.text_begin = ln.air.size();
+    ln.on_air = CaptionRow{};
+    cs.refresh.clear(); cs.refresh_pos = 0;
+    cs.prev_row.clear();
+    cs.curr_row.clear();
+    cs.ru2.started = false;
+    cs.linger_expire_pts = AV_NOPTS_VALUE;
+    ++cs.erasures;
+    std::cerr << "[cc] erase (silence) pts=" << pts << "\n";
+    return true;
+}
+
+static void cc_sched_report(const CaptionScheduler& cs) {
+    if (cs.erasures) std::cerr << "[cc] erasures on silence=" << cs.erasures << "\n";
+    if (cs.refresh_requests)
+        std::cerr << "[cc] gop refresh requested=" << cs.refresh_requests << " sent=" << cs.refresh_sent
+                  << " cut by new rows=" << cs.refresh_cut << "\n";
+    if (!cs.priority_rows && !cs.preempted_rows) return;
+    std::cerr << "[cc] priority rows=" << cs.priority_rows
+              << " latency avg=" << (cs.priority_rows ? (double)cs.priority_latency_sum / cs.priority_rows : 0.0)
+              << " max=" << cs.priority_latency_max << " frame(s), preempted normal rows=" << cs.preempted_rows << "\n";
+}
+
+// ======================================================================================
+// Multicast caption ingest (SO_REUSEPORT shards -> per-channel SPSC queues)
+// ======================================================================================
+//
+// One well-known group carries "@ch=ID,..." messages for many channels. Ingest threads each own
+// a SO_REUSEPORT socket on group:port, so injector processes can share it. Linux hands every
+// multicast datagram to every member socket (reuseport balancing only applies to unicast), so
+// extra threads would only repeat the same receive work: a multicast group gets one thread, and
+// only unicast feeds are spread across N. Every line of a datagram carries its own tag; lines for
+// other channels are dropped after peeking at the header. Each (channel, thread) pair has its
+// own single-producer / single-consumer ring, so no message ever takes a lock.
+
+template <typename T>
+struct SpscRing {
+    std::vector<T> slots;
+    size_t mask = 0;
+    alignas(64) std::atomic<size_t> head{0};   // consumer
+    alignas(64) std::atomic<size_t> tail{0};   // producer
+
+    explicit SpscRing(size_t capacity_pow2) : slots(capacity_pow2), mask(capacity_pow2 - 1) {}
+
+    bool push(T&& v) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) > mask) return false;   // full
+        slots[t & mask] = std::move(v);
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+    bool pop(T& v) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) return false;         // empty
+        v = std::move(slots[h & mask]);
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+};
+
+struct McastIngest {
+    std::string group;
+    std::string iface;                    // local interface address for the join (empty = kernel choice)
+    uint16_t port = 0;
+    bool is_multicast = false;
+    int nthreads = 1;
+
+    std::vector<int> channels;                                         // subscribed IDs (fixed after start)
+    std::vector<std::vector<std::unique_ptr<SpscRing<CaptionSegment>>>> queues;   // [channel slot][thread]
+    std::vector<int> fds;
+    std::vector<RxStats> rx;                                           // per thread, read after join
+    int rcvbuf = 0;
+    std::vector<std::thread> threads;
+    std::atomic<bool> stop{false};
+
+    std::atomic<uint64_t> datagrams{0};
+    std::atomic<uint64_t> foreign{0};     // lines for other channels
+    std::atomic<uint64_t> overflow{0};    // per-channel ring full
+};
+
+static int mcast_channel_slot(const McastIngest& mi, int ch) {
+    for (size_t i = 0; i < mi.channels.size(); ++i) if (mi.channels[i] == ch) return (int)i;
+    return -1;
+}
+
+// Cheap "@ch=ID" peek so threads can drop foreign lines without a full parse. buf is one line of
+// the raw receive buffer (not NUL-terminated), so the digits are read only up to n.
+static int peek_channel_tag(const char* buf, size_t n) {
+    if (n < 5 || buf[0] != '@') return -1;
+    for (size_t i = 1; i + 3 < n && buf[i] != ' ' && buf[i] != '\n'; ++i) {
+        if ((i == 1 || buf[i-1] == ',') && buf[i] == 'c' && buf[i+1] == 'h' && buf[i+2] == '=') {
+            int ch = 0;
+            size_t d = i + 3;
+            for (; d < n && d < i + 12 && buf[d] >= '0' && buf[d] <= '9'; ++d) ch = ch * 10 + (buf[d] - '0');
+            return d > i + 3 ? ch : -1;
+        }
+    }
+    return -1;
+}
+
+static int open_reuseport_socket(const McastIngest& mi) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) return -1;
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0) { close(fd); return -1; }
+    enable_rx_accounting(fd, mi.rcvbuf, "udp://" + mi.group + ":" + std::to_string(mi.port));
+
+    sockaddr_in addr{}; addr.sin_family = AF_INET; addr.sin_port = htons(mi.port);
+    if (inet_aton(mi.group.c_str(), &addr.sin_addr) == 0) { close(fd); return -1; }
+    if (bind(fd, (sockaddr*)&addr, sizeof(addr)) != 0) { close(fd); return -1; }
+
+    if (mi.is_multicast) {
+        ip_mreq mreq{};
+        mreq.imr_multiaddr = addr.sin_addr;
+        mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+        if (!mi.iface.empty() && inet_aton(mi.iface.c_str(), &mreq.imr_interface) == 0) { close(fd); return -1; }
+        if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) != 0) { close(fd); return -1; }
+    }
+    return fd;
+}
+
+static void mcast_ingest_thread(McastIngest* mi, int shard) {
+    int fd = mi->fds[shard];
+    char buf[2048];
+    CaptionSegment seg;
+    RxStats& rx = mi->rx[shard];
+    const std::string label = "ingest#" + std::to_string(shard);
+    pollfd pfd{fd, POLLIN, 0};
+    while (!mi->stop.load(std::memory_order_relaxed)) {
+        if (poll(&pfd, 1, 200) <= 0) continue;
+        for (;;) {
+            ssize_t n = recv_counted(fd, buf, sizeof(buf), MSG_DONTWAIT, rx, label);
+            if (n <= 0) break;
+            mi->datagrams.fetch_add(1, std::memory_order_relaxed);
+
+            // A router may batch several channels' lines into one datagram: route each line
+            for (size_t start = 0; start < (size_t)n; ) {
+                size_t end = start;
+                while (end < (size_t)n && buf[end] != '\n' && buf[end] != '\r') ++end;
+                const char* line = buf + start;
+                const size_t len = end - start;
+                start = end + 1;
+                if (len == 0) continue;
+                int slot = mcast_channel_slot(*mi, peek_channel_tag(line, len));
+                if (slot < 0) {
+                    mi->foreign.fetch_add(1, std::memory_order_relaxed);
+                    continue;
+                }
+                if (!parse_caption_segment(std::string(line, len), seg)) { ++rx.rejects; continue; }
+                if (!mi->queues[slot][shard]->push(std::move(seg)))
+                    mi->overflow.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+    }
+}
+
+static bool mcast_ingest_start(McastIngest& mi, const std::string& group, uint16_t port,
+                               const std::vector<int>& channels, int nthreads) {
+    mi.group = group; mi.port = port;
+    mi.nthreads = std::max(1, nthreads);
+    in_addr a{};
+    if (inet_aton(group.c_str(), &a) == 0) return false;
+    mi.is_multicast = IN_MULTICAST(ntohl(a.s_addr));
+    mi.channels = channels;
+    if (mi.is_multicast && mi.nthreads > 1) {
+        std::cerr << "[cc] multicast: every socket receives every datagram; using one ingest thread\n";
+        mi.nthreads = 1;
+    }
+
+    mi.queues.resize(channels.size());
+    for (auto& per_thread : mi.queues)
+        for (int t = 0; t < mi.nthreads; ++t)
+            per_thread.emplace_back(new SpscRing<CaptionSegment>(256));
+
+    for (int t = 0; t < mi.nthreads; ++t) {
+        int fd = open_reuseport_socket(mi);
+        if (fd < 0) { for (int f : mi.fds) close(f); mi.fds.clear(); return false; }
+        mi.fds.push_back(fd);
+    }
+    mi.rx.resize(mi.nthreads);
+    for (int t = 0; t < mi.nthreads; ++t) mi.threads.emplace_back(mcast_ingest_thread, &mi, t);
+
+    std::cerr << "[cc] " << (mi.is_multicast ? "Multicast" : "Unicast") << " ingest udp://" << group << ":" << port
+              << " threads=" << mi.nthreads << " channels=" << channels.size() << "\n";
+    return true;
+}
+
+// Consumer side (frame loop): drain every shard's ring for one channel slot.
+static bool mcast_ingest_drain(McastIngest& mi, int slot, std::vector<CaptionSegment>& out) {
+    bool got = false;
+    CaptionSegment seg;
+    for (auto& q : mi.queues[slot]) {
+        while (q->pop(seg)) { out.push_back(std::move(seg)); got = true; }
+    }
+    return got;
+}
+
+static void mcast_ingest_stop(McastIngest& mi) {
+    mi.stop.store(true);
+    for (auto& t : mi.threads) if (t.joinable()) t.join();
+    for (int fd : mi.fds) close(fd);
+    if (!mi.threads.empty()) {
+        std::cerr << "[cc] ingest: datagrams=" << mi.datagrams.load() << " foreign=" << mi.foreign.load()
+                  << " overflow=" << mi.overflow.load() << "\n";
+        for (size_t t = 0; t < mi.rx.size(); ++t) log_rx_stats("ingest#" + std::to_string(t), mi.rx[t]);
+    }
+    mi.threads.clear(); mi.fds.clear();
+}
+
+// ======================================================================================
+// Line ingest: stdin / named pipe (scripted jobs, CART stenography output)
+// ======================================================================================
+//
+// A reader thread polls the fd (with a timeout, so it can be stopped) and pulls up to 64 KiB
+// per read(), so bursts of short lines cost one syscall per buffer rather than one per line.
+// Complete lines are parsed with the same "@key=..." header rules as UDP and handed to the
+// frame loop through an SPSC ring. Unlike a socket, a pipe can push back on its writer, so
+// when the ring is full the reader waits for space instead of dropping lines; a trailing
+// line without a terminator is still delivered at EOF.
+// A FIFO is opened read/write so the reader never sees EOF between writers.
+
+struct LineIngest {
+    std::string label;                 // "stdin" or fifo path
+    int fd = -1;
+    bool owns_fd = false;
+    std::thread thread;
+    std::atomic<bool> stop{false};
+    SpscRing<CaptionSegment> queue{4096};
+    std::atomic<uint64_t> lines{0}, reads{0}, overflow{0};
+};
+
+// Queue one complete line; blocks (leaving the fd unread) while the frame loop catches up.
+static void line_ingest_emit(LineIngest* li, const std::string& line) {
+    CaptionSegment seg;
+    if (line.empty() || !parse_caption_segment(line, seg) || seg.text.empty()) return;
+    li->lines.fetch_add(1, std::memory_order_relaxed);
+    while (!li->queue.push(std::move(seg))) {
+        if (li->stop.load(std::memory_order_relaxed)) {
+            li->overflow.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+}
+
+static void line_ingest_thread(LineIngest* li) {
+    std::vector<char> buf(64 * 1024);
+    std::string partial;
+    pollfd pfd{li->fd, POLLIN, 0};
+    while (!li->stop.load(std::memory_order_relaxed)) {
+        int pr = poll(&pfd, 1, 200);
+        if (pr <= 0) continue;
+        ssize_t n = read(li->fd, buf.data(), buf.size());
+        if (n == 0) {
+            line_ingest_emit(li, partial);
+            std::cerr << "[cc] " << li->label << ": EOF\n";
+            break;
+        }
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) continue;
+            std::cerr << "[cc] " << li->label << ": read failed: " << std::strerror(errno) << "\n";
+            break;
+        }
+        li->reads.fetch_add(1, std::memory_order_relaxed);
 
-        // Normalize CR->LF, split by LF, take last non-empty segment
-        for (char& ch : s) if (ch == '\r') ch = '\n';
-        std::string last;
         size_t start = 0;
-        while (true) {
-            size_t pos = s.find('\n', start);
-            std::string seg = (pos == std::string::npos) ? s.substr(start) : s.substr(start, pos - start);
-            if (!seg.empty()) last = seg;
-            if (pos == std::string::npos) break;
-            start = pos + 1;
-        }
-        if (last.empty()) continue;
-
-        // Sanitize to printable ASCII and clamp to 32
-        std::string t; t.reserve(32);
-        for (char c : last) {
-            unsigned char uc = (unsigned char)c;
-            if (uc >= 0x20 && uc <= 0x7E) t.push_back((char)uc);
-            else if (uc == '\t') t.push_back(' ');
-            else break; // stop at control
-            if (t.size() >= 32) break;
-        }
-        trim_inplace(t);
-        if (!t.empty()) {
-            out_line = t;
-            got = true;
-            std::cerr << "[cc] recv: \"" << out_line << "\"\n";
+        for (size_t i = 0; i < (size_t)n; ++i) {
+            if (buf[i] != '\n' && buf[i] != '\r') continue;
+            partial.append(buf.data() + start, i - start);
+            start = i + 1;
+            line_ingest_emit(li, partial);
+            partial.clear();
         }
+        partial.append(buf.data() + start, (size_t)n - start);
+        if (partial.size() > 4096) partial.clear();   // runaway line without a terminator
+    }
+}
+
+// path empty -> stdin
+static bool line_ingest_start(LineIngest& li, const std::string& fifo_path) {
+    if (fifo_path.empty()) {
+        li.label = "stdin";
+        li.fd = STDIN_FILENO;
+    } else {
+        li.label = fifo_path;
+        if (mkfifo(fifo_path.c_str(), 0600) != 0 && errno != EEXIST) return false;
+        li.fd = open(fifo_path.c_str(), O_RDWR | O_NONBLOCK);
+        if (li.fd < 0) return false;
+        li.owns_fd = true;
     }
+    li.thread = std::thread(line_ingest_thread, &li);
+    std::cerr << "[cc] Reading captions from " << li.label << "\n";
+    return true;
+}
+
+static bool line_ingest_drain(LineIngest& li, std::vector<CaptionSegment>& out) {
+    bool got = false;
+    CaptionSegment seg;
+    while (li.queue.pop(seg)) { out.push_back(std::move(seg)); got = true; }
     return got;
 }
 
+static void line_ingest_stop(LineIngest& li) {
+    if (li.fd < 0) return;
+    li.stop.store(true);
+    if (li.thread.joinable()) li.thread.join();
+    std::cerr << "[cc] " << li.label << ": lines=" << li.lines.load() << " reads=" << li.reads.load()
+              << " overflow=" << li.overflow.load() << "\n";
+    if (li.owns_fd) close(li.fd);
+    li.fd = -1;
+}
+
 // ======================================================================================
 // CLI parsing
 // ======================================================================================
@@ -247,6 +1189,16 @@ static bool parse_int_arg(const char* s, const char* key, int& val) {
     return true;
 }
 
+static bool parse_str_arg(const char* s, const char* key, std::string& val) {
+    if (!s) return false;
+    const size_t klen = std::strlen(key);
+    if (std::strncmp(s, key, klen) != 0) return false;
+    const char* eq = s + klen;
+    if (*eq != '=') return false;
+    val = std::string(eq+1);
+    return true;
+}
+
 // ======================================================================================
 // Audio layout helpers (FFmpeg version-guarded)
 // ======================================================================================
@@ -265,53 +1217,3026 @@ static void set_audio_layout_from_decoder(AVCodecContext* aencCtx, const AVCodec
 }
 
 // ======================================================================================
-// Main
+// Audio tap: decoded audio -> 16 kHz mono float -> shared-memory ring for a local STT
 // ======================================================================================
+//
+// Layout of the shm object (little-endian, read by STT.py --tap):
+//   [AudioTapHeader 64 B][AudioTapStamp x stamp_capacity][float x capacity]
+// write_pos counts samples ever written (ring index = pos % capacity). Each published block
+// adds a stamp mapping its first sample to the input PTS in microseconds, so a consumer can
+// return captions as "@t=START-END" on the same timeline the injector schedules against.
+// Stamps are written before write_pos is released; a reader that falls more than
+// `capacity` samples behind must resync.
 
-int main(int argc, char** argv)
-{
-    av_log_set_level(AV_LOG_ERROR);
+struct AudioTapHeader {
+    char     magic[8];          // "CCTAP1"
+    uint32_t version;           // 1
+    uint32_t sample_rate;       // 16000
+    uint32_t capacity;          // samples
+    uint32_t stamp_capacity;    // stamps
+    uint64_t write_pos;         // samples written (monotonic)
+    uint64_t stamp_pos;         // stamps written (monotonic)
+    uint8_t  reserved[24];
+};
+struct AudioTapStamp {
+    uint64_t sample_pos;
+    int64_t  pts_us;
+};
+static_assert(sizeof(AudioTapHeader) == 64, "tap header layout");
+static_assert(sizeof(AudioTapStamp) == 16, "tap stamp layout");
 
-    // Defaults so `./cc_injector` runs without args
-    const char* defaultIn  = "udp://127.0.0.1:5000?timeout=5000000&fifo_size=1000000&overrun_nonfatal=1";
-    const char* defaultOut = "output.ts";
+struct AudioTap {
+    std::string name;
+    int fd = -1;
+    void* map = nullptr;
+    size_t map_size = 0;
+    AudioTapHeader* hdr = nullptr;
+    AudioTapStamp* stamps = nullptr;
+    float* samples = nullptr;
 
-    const char* inUrl  = (argc > 1) ? argv[1] : defaultIn;
-    const char* outUrl = (argc > 2) ? argv[2] : defaultOut;
+    SwrContext* swr = nullptr;
+    int in_rate = 0;
+    int in_fmt = -1;
+    bool swr_failed = false;
+    std::vector<float> scratch;
+    bool enabled = false;     // shm ring open
+};
 
-    // Flags
-    bool use_external_udp_captions = false;
-    std::string cc_host; uint16_t cc_port = 0;
+static const int AUDIO_TAP_RATE = 16000;
 
-    // Defaults: prefer libx264 (SEI/GA94 path), bootstrap on, linger 750ms
-    std::string venc_name = "libx264";
-    int bootstrap_enable = 1;
-    int linger_ms = 750;
+static bool audio_tap_open(AudioTap& tap, const std::string& name, int seconds) {
+    uint32_t cap = 1;
+    while (cap < (uint32_t)std::max(1, seconds) * AUDIO_TAP_RATE) cap <<= 1;
+    const uint32_t stamp_cap = 4096;
+    tap.map_size = sizeof(AudioTapHeader) + stamp_cap * sizeof(AudioTapStamp) + (size_t)cap * sizeof(float);
 
-    for (int i = 1; i < argc; ++i) {
-        if (std::strncmp(argv[i], "--cc-udp=", 9) == 0) {
-            if (!parse_cc_udp_arg(argv[i], cc_host, cc_port)) {
-                std::cerr << "Invalid --cc-udp format. Use --cc-udp=HOST:PORT (e.g. --cc-udp=127.0.0.1:54001)\n";
-                return 1;
-            }
-            use_external_udp_captions = true;
-        } else if (std::strncmp(argv[i], "--venc=", 7) == 0) {
+    tap.fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0600);
+    if (tap.fd < 0) return false;
+    if (ftruncate(tap.fd, (off_t)tap.map_size) != 0) { close(tap.fd); tap.fd = -1; return false; }
+    tap.map = mmap(nullptr, tap.map_size, PROT_READ | PROT_WRITE, MAP_SHARED, tap.fd, 0);
+    if (tap.map == MAP_FAILED) { tap.map = nullptr; close(tap.fd); tap.fd = -1; return false; }
+
+    tap.hdr     = (AudioTapHeader*)tap.map;
+    tap.stamps  = (AudioTapStamp*)((uint8_t*)tap.map + sizeof(AudioTapHeader));
+    tap.samples = (float*)((uint8_t*)tap.stamps + stamp_cap * sizeof(AudioTapStamp));
+
+    std::memset(tap.hdr, 0, sizeof(AudioTapHeader));
+    tap.hdr->version        = 1;
+    tap.hdr->sample_rate    = AUDIO_TAP_RATE;
+    tap.hdr->capacity       = cap;
+    tap.hdr->stamp_capacity = stamp_cap;
+    std::memcpy(tap.hdr->magic, "CCTAP1", 7);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    tap.name = name; tap.enabled = true;
+    std::cerr << "[tap] shm " << name << " " << cap << " samples @" << AUDIO_TAP_RATE << " Hz mono f32\n";
+    return true;
+}
+
+static void audio_tap_close(AudioTap& tap) {
+    if (tap.swr) swr_free(&tap.swr);
+    if (tap.map) munmap(tap.map, tap.map_size);
+    if (tap.fd >= 0) close(tap.fd);
+    if (!tap.name.empty()) shm_unlink(tap.name.c_str());
+    tap = AudioTap{};
+}
+
+// (Re)create the resampler when the decoder's format or rate changes mid-stream.
+static bool audio_tap_setup_swr(AudioTap& tap, const AVFrame* f) {
+    if (tap.swr && tap.in_rate == f->sample_rate && tap.in_fmt == f->format) return true;
+    if (tap.swr) swr_free(&tap.swr);
+#if LIBAVCODEC_VERSION_MAJOR >= 59
+    AVChannelLayout mono = AV_CHANNEL_LAYOUT_MONO;
+    if (swr_alloc_set_opts2(&tap.swr, &mono, AV_SAMPLE_FMT_FLT, AUDIO_TAP_RATE,
+                            &f->ch_layout, (AVSampleFormat)f->format, f->sample_rate, 0, nullptr) < 0)
+        return false;
+#else
+    int64_t in_layout = f->channel_layout ? (int64_t)f->channel_layout : (int64_t)AV_CH_LAYOUT_STEREO;
+    tap.swr = swr_alloc_set_opts(nullptr, AV_CH_LAYOUT_MONO, AV_SAMPLE_FMT_FLT, AUDIO_TAP_RATE,
+                                 in_layout, (AVSampleFormat)f->format, f->sample_rate, 0, nullptr);
+#endif
+    if (!tap.swr || swr_init(tap.swr) < 0) { if (tap.swr) swr_free(&tap.swr); return false; }
+    tap.in_rate = f->sample_rate;
+    tap.in_fmt  = f->format;
+    return true;
+}
+
+// Resample one decoded frame into tap.scratch. Returns the sample count and sets pts_us to the
+// input PTS of the first output sample (AV_NOPTS_VALUE if the frame has none).
+static int audio_tap_resample(AudioTap& tap, const AVFrame* f, AVRational tb, int64_t& pts_us) {
+    if (tap.swr_failed || f->nb_samples <= 0 || f->sample_rate <= 0) return 0;
+    if (!audio_tap_setup_swr(tap, f)) { std::cerr << "[tap] resampler setup failed; tap disabled\n"; tap.swr_failed = true; return 0; }
+
+    // First output sample of this call corresponds to the frame PTS minus what swr still holds
+    int64_t delay_us = swr_get_delay(tap.swr, 1000000);
+    int max_out = swr_get_out_samples(tap.swr, f->nb_samples);
+    if (max_out <= 0) return 0;
+    if (tap.scratch.size() < (size_t)max_out) tap.scratch.resize((size_t)max_out);
+
+    uint8_t* out[1] = { (uint8_t*)tap.scratch.data() };
+    int n = swr_convert(tap.swr, out, max_out, (const uint8_t**)f->extended_data, f->nb_samples);
+    pts_us = (f->pts == AV_NOPTS_VALUE) ? AV_NOPTS_VALUE
+                                        : av_rescale_q(f->pts, tb, AVRational{1, 1000000}) - delay_us;
+    return std::max(n, 0);
+}
+
+// Publish the last resampled block (tap.scratch[0..n)) to the shm ring.
+static void audio_tap_publish(AudioTap& tap, int n, int64_t pts_us) {
+    if (!tap.enabled || n <= 0) return;
+
+    const uint64_t cap = tap.hdr->capacity;
+    uint64_t pos = tap.hdr->write_pos;
+    size_t idx = (size_t)(pos & (cap - 1));
+    size_t first = std::min<size_t>((size_t)n, (size_t)(cap - idx));
+    std::memcpy(tap.samples + idx, tap.scratch.data(), first * sizeof(float));
+    if ((size_t)n > first) std::memcpy(tap.samples, tap.scratch.data() + first, ((size_t)n - first) * sizeof(float));
+
+    if (pts_us != AV_NOPTS_VALUE) {
+        uint64_t sp = tap.hdr->stamp_pos;
+        AudioTapStamp& st = tap.stamps[sp % tap.hdr->stamp_capacity];
+        st.sample_pos = pos;
+        st.pts_us = pts_us;
+        __atomic_store_n(&tap.hdr->stamp_pos, sp + 1, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&tap.hdr->write_pos, pos + (uint64_t)n, __ATOMIC_RELEASE);
+}
+
+// ======================================================================================
+// Voice activity (decoded audio energy) -> caption clearing
+// ======================================================================================
+//
+// Each decoded audio frame is reduced to one RMS level (SSE2 sum of squares where available,
+// scalar otherwise), well under a microsecond for a typical 1024-sample AAC frame. Frames above
+// the threshold are merged into voiced intervals on the video PTS timeline. Audio is decoded
+// ahead of the picture being encoded (and far ahead with --video_delay_ms), so silence is
+// looked up at the output PTS rather than taken from the latest frame.
+
+struct AudioVad {
+    bool enabled = false;
+    double threshold_db = -45.0;         // dBFS
+    int64_t silence_ticks = 0;           // video encoder time base
+    int64_t gap_ticks = 0;               // shorter pauses are merged into one interval
+    std::deque<std::pair<int64_t,int64_t>> voiced;   // [start, end] PTS, ascending
+    uint64_t frames = 0, voiced_frames = 0, unsupported = 0;
+    int64_t analysis_ns = 0;
+};
+
+static double sum_squares_f32(const float* x, int n) {
+    int i = 0;
+    double sum = 0.0;
+#if defined(__SSE2__)
+    __m128 a0 = _mm_setzero_ps(), a1 = _mm_setzero_ps();
+    for (; i + 8 <= n; i += 8) {
+        __m128 v0 = _mm_loadu_ps(x + i), v1 = _mm_loadu_ps(x + i + 4);
+        a0 = _mm_add_ps(a0, _mm_mul_ps(v0, v0));
+        a1 = _mm_add_ps(a1, _mm_mul_ps(v1, v1));
+    }
+    alignas(16) float lanes[4];
+    _mm_store_ps(lanes, _mm_add_ps(a0, a1));
+    sum = (double)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+    for (; i < n; ++i) sum += (double)x[i] * x[i];
+    return sum;
+}
+
+static double sum_squares_s16(const int16_t* x, int n) {
+    int i = 0;
+    uint64_t sum = 0;
+#if defined(__SSE2__)
+    // madd gives x0^2+x1^2 per 32-bit lane; that fits unsigned 32 bits, so widen before adding
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = _mm_setzero_si128();
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(x + i));
+        __m128i sq = _mm_madd_epi16(v, v);
+        acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(sq, zero));
+        acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(sq, zero));
+    }
+    alignas(16) uint64_t lanes[2];
+    _mm_store_si128((__m128i*)lanes, acc);
+    sum = lanes[0] + lanes[1];
+#endif
+    for (; i < n; ++i) sum += (uint64_t)((int32_t)x[i] * x[i]);
+    return (double)sum / (32768.0 * 32768.0);
+}
+
+static int audio_frame_channels(const AVFrame* f) {
+#if LIBAVCODEC_VERSION_MAJOR >= 59
+    return f->ch_layout.nb_channels;
+#else
+    return f->channels;
+#endif
+}
+
+// RMS level of one frame in dBFS; false for sample formats we do not analyze.
+static bool audio_frame_level_db(const AVFrame* f, double& db) {
+    const AVSampleFormat fmt = (AVSampleFormat)f->format;
+    const int ch = std::max(1, audio_frame_channels(f));
+    const bool planar = av_sample_fmt_is_planar(fmt);
+    const int planes = planar ? ch : 1;
+    const int per_plane = planar ? f->nb_samples : f->nb_samples * ch;
+    double sum = 0.0;
+    for (int p = 0; p < planes; ++p) {
+        switch (av_get_packed_sample_fmt(fmt)) {
+        case AV_SAMPLE_FMT_FLT: sum += sum_squares_f32((const float*)f->extended_data[p], per_plane); break;
+        case AV_SAMPLE_FMT_S16: sum += sum_squares_s16((const int16_t*)f->extended_data[p], per_plane); break;
+        default: return false;
+        }
+    }
+    const double n = (double)per_plane * planes;
+    db = (n > 0 && sum > 0) ? 10.0 * std::log10(sum / n) : -120.0;
+    return true;
+}
+
+static void vad_init(AudioVad& vad, int silence_ms, int threshold_db, AVRational video_tb) {
+    vad.enabled = silence_ms > 0;
+    vad.threshold_db = threshold_db;
+    vad.silence_ticks = av_rescale_q(silence_ms, AVRational{1,1000}, video_tb);
+    vad.gap_ticks = av_rescale_q(200, AVRational{1,1000}, video_tb);
+}
+
+// Analyze one decoded frame; pts/dur are on the video encoder timeline.
+static void vad_feed(AudioVad& vad, const AVFrame* f, int64_t pts, int64_t dur) {
+    auto t0 = std::chrono::steady_clock::now();
+    double db = 0.0;
+    bool ok = audio_frame_level_db(f, db);
+    vad.analysis_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count();
+    if (!ok) { ++vad.unsupported; return; }
+    ++vad.frames;
+    if (db < vad.threshold_db || pts == AV_NOPTS_VALUE) return;
+    ++vad.voiced_frames;
+    if (!vad.voiced.empty() && pts <= vad.voiced.back().second + vad.gap_ticks)
+        vad.voiced.back().second = std::max(vad.voiced.back().second, pts + dur);
+    else
+        vad.voiced.emplace_back(pts, pts + dur);
+}
+
+// True when nothing was voiced during the silence window ending at pts.
+static bool vad_silent_at(AudioVad& vad, int64_t pts) {
+    // Intervals that ended before the window can go, except the newest of them
+    while (vad.voiced.size() > 1 && vad.voiced[1].second < pts - vad.silence_ticks) vad.voiced.pop_front();
+    for (const auto& iv : vad.voiced) {
+        if (iv.first > pts) break;
+        if (iv.second >= pts - vad.silence_ticks) return false;
+    }
+    return true;
+}
+
+static void vad_report(const AudioVad& vad) {
+    if (!vad.enabled) return;
+    std::cerr << "[vad] frames=" << vad.frames << " voiced=" << vad.voiced_frames
+              << " unsupported=" << vad.unsupported << " avg=" << (vad.frames ? vad.analysis_ns / (int64_t)vad.frames : 0)
+              << " ns/frame\n";
+}
+
+// ======================================================================================
+// Buffer pools + allocation debug counter (no heap traffic per frame in steady state)
+// ======================================================================================
+//
+// Everything the frame loop needs per picture is recycled. Picture planes and cc_data side data
+// come from AVBufferPools; a buffer goes back to its pool when the last reference (encoder,
+// delay line, ladder rung) drops it. Scratch state (cc_data bytes, lane triplets, caption rows,
+// queue slots) lives in fixed arrays or in vectors whose capacity is kept. FFmpeg still allocates
+// its small AVBufferRef/AVFrameSideData wrappers internally; those are outside our control.
+//
+// Build with -DCC_ALLOC_DEBUG to count operator new calls on each thread. After warm-up, every
+// emitted picture that allocated is logged, and the final report flags the run as failed. Frames
+// on which captions arrived or the encoder was swapped are exempt: they allocate by design.
+
+#ifdef CC_ALLOC_DEBUG
+static thread_local uint64_t g_thread_allocs = 0;
+
+void* operator new(std::size_t n) {
+    ++g_thread_allocs;
+    if (void* p = std::malloc(n ? n : 1)) return p;
+    throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+static inline uint64_t cc_alloc_count() { return g_thread_allocs; }
+#else
+static inline uint64_t cc_alloc_count() { return 0; }
+#endif
+
+struct AllocCheck {
+    int64_t warmup = 300;        // pictures before the check starts
+    int64_t frames = 0;
+    uint64_t dirty = 0, allocs = 0, exempt = 0;
+};
+
+// One emitted picture: allocs is the operator new count it caused.
+static void alloc_check_frame(AllocCheck& ac, uint64_t allocs, bool exempt) {
+    if (++ac.frames <= ac.warmup || !allocs) return;
+    if (exempt) { ++ac.exempt; return; }
+    ++ac.dirty;
+    ac.allocs += allocs;
+    if (ac.dirty <= 10) std::cerr << "[alloc] frame " << ac.frames << ": " << allocs << " heap allocation(s) in steady state\n";
+}
+
+static void alloc_check_report(const AllocCheck& ac) {
+#ifdef CC_ALLOC_DEBUG
+    std::cerr << "[alloc] frames=" << ac.frames << " (warm-up " << ac.warmup << ") allocating=" << ac.dirty
+              << " allocations=" << ac.allocs << " exempt=" << ac.exempt
+              << (ac.dirty ? " -> FAILED" : " -> zero per-frame allocations") << "\n";
+#else
+    (void)ac;
+#endif
+}
+
+// 8-bit 4:2:0 pictures of one size from three per-plane pools. Lines are 64-byte aligned with
+// tail padding for SIMD readers.
+struct PlanePool {
+    AVBufferPool* pool[3] = {nullptr, nullptr, nullptr};
+    int linesize[3] = {0, 0, 0};
+    int w = 0, h = 0;
+};
+
+static bool plane_pool_init(PlanePool& pp, int w, int h) {
+    pp.w = w; pp.h = h;
+    for (int p = 0; p < 3; ++p) {
+        int pw = p ? (w + 1) >> 1 : w, ph = p ? (h + 1) >> 1 : h;
+        pp.linesize[p] = (pw + 63) & ~63;
+        pp.pool[p] = av_buffer_pool_init((size_t)pp.linesize[p] * ph + 64, av_buffer_alloc);
+        if (!pp.pool[p]) return false;
+    }
+    return true;
+}
+
+// dst must be unreferenced; on failure it is left unreferenced.
+static bool plane_pool_get(PlanePool& pp, AVFrame* dst) {
+    dst->width = pp.w; dst->height = pp.h; dst->format = AV_PIX_FMT_YUV420P;
+    for (int p = 0; p < 3; ++p) {
+        dst->buf[p] = av_buffer_pool_get(pp.pool[p]);
+        if (!dst->buf[p]) { av_frame_unref(dst); return false; }
+        dst->data[p] = dst->buf[p]->data;
+        dst->linesize[p] = pp.linesize[p];
+    }
+    dst->extended_data = dst->data;
+    return true;
+}
+
+static void plane_pool_uninit(PlanePool& pp) {
+    for (AVBufferPool*& p : pp.pool) av_buffer_pool_uninit(&p);
+}
+
+// Attach cc_data as a pooled buffer. Pool buffers are CC_DATA_MAX bytes, so the reference is
+// shortened to the bytes actually used: av_frame_ref() rebuilds side data from buf->size, so
+// shortening only sd->size would not survive the copy avcodec_send_frame() makes.
+static bool attach_cc_side_data(AVFrame* f, AVBufferPool* pool, const CcData& cc) {
+    if (!cc.size) return true;
+    AVBufferRef* ref = av_buffer_pool_get(pool);
+    if (!ref) return false;
+    std::memcpy(ref->data, cc.bytes, cc.size);
+    ref->size = cc.size;
+    if (!av_frame_new_side_data_from_buf(f, AV_FRAME_DATA_A53_CC, ref)) { av_buffer_unref(&ref); return false; }
+    return true;
+}
+
+// ======================================================================================
+// Pixel format conversion (10-bit / 4:2:2 contribution -> 8-bit 4:2:0 for the encoder)
+// ======================================================================================
+//
+// Decoded pictures are converted right after decode, so the delay line, the ladder and the
+// encoder only ever see the delivery format. yuv422p10le, yuv420p10le and yuv422p -> yuv420p use a
+// dedicated kernel: SSE2 round-and-shift for depth, and a vertical chroma average for 4:2:2.
+// On interlaced pictures the average pairs lines of the same field. Every other pair goes
+// through swscale with its own slice threads. The kernel splits each picture into horizontal
+// bands and runs them on a small persistent worker pool, with the frame loop taking the first
+// band itself. Output planes come from AVBufferPools, so buffers are recycled once the encoder
+// (or delay line / ladder) drops its reference.
+
+struct PixConv {
+    bool enabled = false;
+    bool custom = false;                 // SIMD kernel (else swscale)
+    AVPixelFormat src_fmt = AV_PIX_FMT_NONE, dst_fmt = AV_PIX_FMT_YUV420P;
+    int w = 0, h = 0;
+    int src_shift = 0;                   // 2 for 10-bit input
+    bool src_422 = false;
+    SwsContext* sws = nullptr;
+    PlanePool planes;
+    AVFrame* out = nullptr;
+
+    // slice workers
+    int nslices = 1;
+    std::vector<std::thread> workers;
+    std::mutex mu;
+    std::condition_variable cv, done_cv;
+    uint64_t gen = 0;
+    int pending = 0;
+    bool stop = false;
+    const AVFrame* job_src = nullptr;
+    AVFrame* job_dst = nullptr;
+
+    // cost
+    uint64_t frames = 0;
+    int64_t total_us = 0, max_us = 0;
+    double frame_us = 33366.0;
+    bool warned = false;
+};
+
+static inline bool frame_is_interlaced(const AVFrame* f) {
+#ifdef AV_FRAME_FLAG_INTERLACED
+    return (f->flags & AV_FRAME_FLAG_INTERLACED) != 0;
+#else
+    return f->interlaced_frame != 0;
+#endif
+}
+
+// (x + 2) >> 2: 10-bit -> 8-bit with rounding
+static void pixconv_pack10(const uint16_t* s, uint8_t* d, int w) {
+    int x = 0;
+#if defined(__SSE2__)
+    const __m128i two = _mm_set1_epi16(2);
+    for (; x + 16 <= w; x += 16) {
+        __m128i a = _mm_srli_epi16(_mm_add_epi16(_mm_loadu_si128((const __m128i*)(s + x)), two), 2);
+        __m128i b = _mm_srli_epi16(_mm_add_epi16(_mm_loadu_si128((const __m128i*)(s + x + 8)), two), 2);
+        _mm_storeu_si128((__m128i*)(d + x), _mm_packus_epi16(a, b));
+    }
+#endif
+    for (; x < w; ++x) d[x] = (uint8_t)std::min((s[x] + 2) >> 2, 255);
+}
+
+// (a + b + 4) >> 3: average two 10-bit chroma lines into one 8-bit line
+static void pixconv_avg10(const uint16_t* a, const uint16_t* b, uint8_t* d, int w) {
+    int x = 0;
+#if defined(__SSE2__)
+    const __m128i four = _mm_set1_epi16(4);
+    for (; x + 16 <= w; x += 16) {
+        __m128i lo = _mm_add_epi16(_mm_loadu_si128((const __m128i*)(a + x)), _mm_loadu_si128((const __m128i*)(b + x)));
+        __m128i hi = _mm_add_epi16(_mm_loadu_si128((const __m128i*)(a + x + 8)), _mm_loadu_si128((const __m128i*)(b + x + 8)));
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, four), 3);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, four), 3);
+        _mm_storeu_si128((__m128i*)(d + x), _mm_packus_epi16(lo, hi));
+    }
+#endif
+    for (; x < w; ++x) d[x] = (uint8_t)std::min((a[x] + b[x] + 4) >> 3, 255);
+}
+
+static void pixconv_avg8(const uint8_t* a, const uint8_t* b, uint8_t* d, int w) {
+    int x = 0;
+#if defined(__SSE2__)
+    for (; x + 16 <= w; x += 16)
+        _mm_storeu_si128((__m128i*)(d + x), _mm_avg_epu8(_mm_loadu_si128((const __m128i*)(a + x)),
+                                                         _mm_loadu_si128((const __m128i*)(b + x))));
+#endif
+    for (; x < w; ++x) d[x] = (uint8_t)((a[x] + b[x] + 1) >> 1);
+}
+
+// Input chroma lines feeding output chroma line j of a 4:2:0 picture (4:2:2 source).
+// Progressive: 2j, 2j+1. Interlaced: output line j belongs to field j&1, and so do its sources.
+static inline void pixconv_chroma_src_rows(int j, bool interlaced, int src_rows, int& r0, int& r1) {
+    if (interlaced) { r0 = 4 * (j >> 1) + (j & 1); r1 = r0 + 2; }
+    else            { r0 = 2 * j;                   r1 = r0 + 1; }
+    r0 = std::min(r0, src_rows - 1);
+    r1 = std::min(r1, src_rows - 1);
+}
+
+// Convert luma rows [y0, y1) and the matching chroma rows; y0/y1 are multiples of 4.
+static void pixconv_band(const PixConv& pc, const AVFrame* src, AVFrame* dst, int y0, int y1) {
+    const bool il = frame_is_interlaced(src);
+    for (int y = y0; y < y1; ++y) {
+        const uint8_t* s = src->data[0] + (ptrdiff_t)y * src->linesize[0];
+        uint8_t* d = dst->data[0] + (ptrdiff_t)y * dst->linesize[0];
+        if (pc.src_shift) pixconv_pack10((const uint16_t*)s, d, pc.w);
+        else              std::memcpy(d, s, pc.w);
+    }
+    const int cw = (pc.w + 1) >> 1, src_ch = pc.src_422 ? pc.h : (pc.h + 1) >> 1;
+    for (int p = 1; p <= 2; ++p) {
+        const int j1 = (y1 == pc.h) ? (pc.h + 1) >> 1 : y1 >> 1;
+        for (int j = y0 >> 1; j < j1; ++j) {
+            uint8_t* d = dst->data[p] + (ptrdiff_t)j * dst->linesize[p];
+            if (!pc.src_422) {           // 4:2:0 10-bit: depth only
+                pixconv_pack10((const uint16_t*)(src->data[p] + (ptrdiff_t)j * src->linesize[p]), d, cw);
+                continue;
+            }
+            int r0, r1;
+            pixconv_chroma_src_rows(j, il, src_ch, r0, r1);
+            const uint8_t* a = src->data[p] + (ptrdiff_t)r0 * src->linesize[p];
+            const uint8_t* b = src->data[p] + (ptrdiff_t)r1 * src->linesize[p];
+            if (pc.src_shift) pixconv_avg10((const uint16_t*)a, (const uint16_t*)b, d, cw);
+            else              pixconv_avg8(a, b, d, cw);
+        }
+    }
+}
+
+static void pixconv_slice(const PixConv& pc, const AVFrame* src, AVFrame* dst, int k) {
+    int y0 = (int)((int64_t)pc.h * k / pc.nslices) & ~3;
+    int y1 = k + 1 == pc.nslices ? pc.h : (int)((int64_t)pc.h * (k + 1) / pc.nslices) & ~3;
+    if (y1 > y0) pixconv_band(pc, src, dst, y0, y1);
+}
+
+static void pixconv_worker(PixConv* pc, int k) {
+    uint64_t seen = 0;
+    for (;;) {
+        std::unique_lock<std::mutex> lk(pc->mu);
+        pc->cv.wait(lk, [&] { return pc->stop || pc->gen != seen; });
+        if (pc->stop) return;
+        seen = pc->gen;
+        const AVFrame* src = pc->job_src;
+        AVFrame* dst = pc->job_dst;
+        lk.unlock();
+        pixconv_slice(*pc, src, dst, k);
+        lk.lock();
+        if (--pc->pending == 0) pc->done_cv.notify_one();
+    }
+}
+
+static bool pixconv_custom_supported(AVPixelFormat src, AVPixelFormat dst) {
+    return dst == AV_PIX_FMT_YUV420P &&
+           (src == AV_PIX_FMT_YUV422P10LE || src == AV_PIX_FMT_YUV420P10LE || src == AV_PIX_FMT_YUV422P);
+}
+
+static bool pixconv_init(PixConv& pc, int w, int h, AVPixelFormat src, AVPixelFormat dst, int threads,
+                         bool force_sws, AVRational frame_rate) {
+    // Output planes come from a 4:2:0 PlanePool: only 8-bit planar 4:2:0 targets fit
+    const AVPixFmtDescriptor* dd = av_pix_fmt_desc_get(dst);
+    if (!dd || dd->nb_components != 3 || !(dd->flags & AV_PIX_FMT_FLAG_PLANAR) || dd->comp[0].depth != 8 ||
+        dd->log2_chroma_w != 1 || dd->log2_chroma_h != 1) return false;
+    pc.w = w; pc.h = h; pc.src_fmt = src; pc.dst_fmt = dst;
+    pc.frame_us = 1e6 / (frame_rate.num ? av_q2d(frame_rate) : 30.0);
+    threads = std::max(1, threads);
+    pc.custom = !force_sws && pixconv_custom_supported(src, dst);
+    if (pc.custom) {
+        pc.src_shift = (src == AV_PIX_FMT_YUV422P) ? 0 : 2;
+        pc.src_422 = (src != AV_PIX_FMT_YUV420P10LE);
+        pc.nslices = std::min(threads, std::max(1, h / 64));
+        for (int k = 1; k < pc.nslices; ++k) pc.workers.emplace_back(pixconv_worker, &pc, k);
+    } else {
+#if LIBSWSCALE_VERSION_INT >= AV_VERSION_INT(6, 1, 100)
+        pc.sws = sws_alloc_context();
+        if (!pc.sws) return false;
+        av_opt_set_int(pc.sws, "srcw", w, 0);
+        av_opt_set_int(pc.sws, "srch", h, 0);
+        av_opt_set_int(pc.sws, "src_format", src, 0);
+        av_opt_set_int(pc.sws, "dstw", w, 0);
+        av_opt_set_int(pc.sws, "dsth", h, 0);
+        av_opt_set_int(pc.sws, "dst_format", dst, 0);
+        av_opt_set_int(pc.sws, "sws_flags", SWS_BICUBIC, 0);
+        av_opt_set_int(pc.sws, "threads", threads, 0);
+        if (sws_init_context(pc.sws, nullptr, nullptr) < 0) { sws_freeContext(pc.sws); pc.sws = nullptr; return false; }
+#else
+        pc.sws = sws_getContext(w, h, src, w, h, dst, SWS_BICUBIC, nullptr, nullptr, nullptr);
+        if (!pc.sws) return false;
+#endif
+    }
+
+    if (!plane_pool_init(pc.planes, w, h)) return false;
+    pc.out = av_frame_alloc();
+    pc.enabled = pc.out != nullptr;
+    return pc.enabled;
+}
+
+// Returns pc.out (valid until the next call), or nullptr on failure.
+static AVFrame* pixconv_run(PixConv& pc, const AVFrame* src) {
+    if (src->width != pc.w || src->height != pc.h || src->format != pc.src_fmt) return nullptr;
+    int64_t t0 = av_gettime_relative();
+    AVFrame* dst = pc.out;
+    av_frame_unref(dst);
+    if (!plane_pool_get(pc.planes, dst)) return nullptr;
+    dst->format = pc.dst_fmt;
+    if (av_frame_copy_props(dst, src) < 0) { av_frame_unref(dst); return nullptr; }
+
+    bool ok = true;
+    if (pc.custom) {
+        {
+            std::lock_guard<std::mutex> lk(pc.mu);
+            pc.job_src = src; pc.job_dst = dst;
+            pc.pending = pc.nslices - 1;
+            ++pc.gen;
+        }
+        pc.cv.notify_all();
+        pixconv_slice(pc, src, dst, 0);
+        std::unique_lock<std::mutex> lk(pc.mu);
+        pc.done_cv.wait(lk, [&] { return pc.pending == 0; });
+    } else {
+#if LIBSWSCALE_VERSION_INT >= AV_VERSION_INT(6, 1, 100)
+        ok = sws_scale_frame(pc.sws, dst, src) >= 0;
+#else
+        ok = sws_scale(pc.sws, src->data, src->linesize, 0, pc.h, dst->data, dst->linesize) > 0;
+#endif
+    }
+    if (!ok) { av_frame_unref(dst); return nullptr; }
+
+    int64_t us = av_gettime_relative() - t0;
+    ++pc.frames;
+    pc.total_us += us;
+    pc.max_us = std::max(pc.max_us, us);
+    if (!pc.warned && pc.frames >= 100 && pc.total_us / (double)pc.frames > 0.5 * pc.frame_us) {
+        pc.warned = true;
+        std::cerr << "[pixconv] conversion averages " << pc.total_us / pc.frames << " us/frame, over half the "
+                  << (int64_t)pc.frame_us << " us frame interval; raise --pixconv_threads\n";
+    }
+    return dst;
+}
+
+static void pixconv_close(PixConv& pc) {
+    if (pc.frames)
+        std::cerr << "[pixconv] " << av_get_pix_fmt_name(pc.src_fmt) << " -> " << av_get_pix_fmt_name(pc.dst_fmt)
+                  << (pc.custom ? " (simd x" + std::to_string(pc.nslices) + ")" : std::string(" (swscale)"))
+                  << ": frames=" << pc.frames << " avg=" << pc.total_us / (int64_t)pc.frames << "us max=" << pc.max_us
+                  << "us (" << 100.0 * pc.total_us / pc.frames / pc.frame_us << "% of frame interval)\n";
+    {
+        std::lock_guard<std::mutex> lk(pc.mu);
+        pc.stop = true;
+    }
+    pc.cv.notify_all();
+    for (std::thread& t : pc.workers) t.join();
+    pc.workers.clear();
+    av_frame_free(&pc.out);
+    plane_pool_uninit(pc.planes);
+    sws_freeContext(pc.sws);
+    pc.sws = nullptr;
+    pc.enabled = false;
+}
+
+// --bench_pixconv=N: time N synthetic 1080p yuv422p10le pictures through the SIMD kernel and
+// through swscale (same thread count) and print ms/frame for both.
+static int pixconv_bench(int frames, int threads) {
+    const int w = 1920, h = 1080;
+    AVFrame* src = av_frame_alloc();
+    src->width = w; src->height = h; src->format = AV_PIX_FMT_YUV422P10LE;
+    if (av_frame_get_buffer(src, 0) < 0) return 1;
+    for (int p = 0; p < 3; ++p) {
+        int pw = p ? w / 2 : w;
+        for (int y = 0; y < h; ++y) {
+            uint16_t* row = (uint16_t*)(src->data[p] + (ptrdiff_t)y * src->linesize[p]);
+            for (int x = 0; x < pw; ++x) row[x] = (uint16_t)(64 + (x * 7 + y * 3 + p * 101) % 877);
+        }
+    }
+    for (int mode = 0; mode < 2; ++mode) {
+        PixConv pc{};
+        if (!pixconv_init(pc, w, h, AV_PIX_FMT_YUV422P10LE, AV_PIX_FMT_YUV420P, threads, mode == 1, AVRational{30000, 1001})) {
+            std::cerr << "[bench] init failed (" << (mode ? "swscale" : "simd") << ")\n";
+            continue;
+        }
+        int64_t t0 = av_gettime_relative();
+        for (int i = 0; i < frames; ++i) { src->pts = i; pixconv_run(pc, src); }
+        double ms = (av_gettime_relative() - t0) / 1000.0 / std::max(frames, 1);
+        std::cout << (mode ? "swscale" : "simd   ") << " 1920x1080 yuv422p10le->yuv420p threads=" << threads
+                  << ": " << ms << " ms/frame (" << 1000.0 / ms << " fps)\n";
+        pc.frames = 0;
+        pixconv_close(pc);
+    }
+    av_frame_free(&src);
+    return 0;
+}
+
+// ======================================================================================
+// Field handling (scan-type probe, interlaced encode, yadif/bwdif deinterlace)
+// ======================================================================================
+//
+// The first pictures of the input are decoded once before the encoder is opened to learn the
+// scan type and field order from the frame flags; their packets are then replayed through the
+// normal loop. --field_mode=interlaced codes interlaced pictures as interlaced (libx264: MBAFF,
+// mpeg2video: field DCT/ME; each picture's own field order is passed through). libx264 has no
+// PAFF, so paff is accepted as an alias. --field_mode=deinterlace runs yadif or bwdif in a
+// libavfilter graph with slice threads, one output frame per input frame (mode=send_frame), so
+// timestamps and caption pacing do not change. Pictures flagged progressive pass through.
+
+static const int kFieldProbeFrames = 10;
+static const size_t kFieldProbeMaxPackets = 600;
+
+static inline bool frame_is_tff(const AVFrame* f) {
+#ifdef AV_FRAME_FLAG_TOP_FIELD_FIRST
+    return (f->flags & AV_FRAME_FLAG_TOP_FIELD_FIRST) != 0;
+#else
+    return f->top_field_first != 0;
+#endif
+}
+
+struct FieldProbe {
+    int frames = 0, interlaced = 0, tff = 0;
+};
+
+static void field_probe_note(FieldProbe& fp, const AVFrame* f) {
+    ++fp.frames;
+    if (!frame_is_interlaced(f)) return;
+    ++fp.interlaced;
+    if (frame_is_tff(f)) ++fp.tff;
+}
+
+// Majority vote: PROGRESSIVE, TT or BB (UNKNOWN if nothing was decoded).
+static AVFieldOrder field_probe_result(const FieldProbe& fp) {
+    if (!fp.frames) return AV_FIELD_UNKNOWN;
+    if (2 * fp.interlaced < fp.frames) return AV_FIELD_PROGRESSIVE;
+    return 2 * fp.tff >= fp.interlaced ? AV_FIELD_TT : AV_FIELD_BB;
+}
+
+static const char* field_order_name(AVFieldOrder fo) {
+    switch (fo) {
+    case AV_FIELD_PROGRESSIVE: return "progressive";
+    case AV_FIELD_TT: return "interlaced TFF";
+    case AV_FIELD_BB: return "interlaced BFF";
+    case AV_FIELD_TB: return "interlaced TB";
+    case AV_FIELD_BT: return "interlaced BT";
+    default: return "unknown";
+    }
+}
+
+// Reads packets until kFieldProbeFrames pictures decoded (or the packet cap), keeping every
+// packet in replay, then resets the decoder so the replay decodes from the start again.
+static AVFieldOrder field_probe_input(AVFormatContext* ifmt, int vIdx, AVCodecContext* vdecCtx,
+                                      std::deque<AVPacket*>& replay) {
+    FieldProbe fp;
+    AVPacket* pkt = av_packet_alloc();
+    AVFrame* frm = av_frame_alloc();
+    if (!pkt || !frm) { av_packet_free(&pkt); av_frame_free(&frm); return AV_FIELD_UNKNOWN; }
+    while (fp.frames < kFieldProbeFrames && replay.size() < kFieldProbeMaxPackets && av_read_frame(ifmt, pkt) >= 0) {
+        if (pkt->stream_index == vIdx && avcodec_send_packet(vdecCtx, pkt) == 0) {
+            while (avcodec_receive_frame(vdecCtx, frm) == 0) { field_probe_note(fp, frm); av_frame_unref(frm); }
+        }
+        AVPacket* keep = av_packet_alloc();
+        if (keep) { av_packet_move_ref(keep, pkt); replay.push_back(keep); }
+        av_packet_unref(pkt);
+    }
+    avcodec_flush_buffers(vdecCtx);
+    av_packet_free(&pkt);
+    av_frame_free(&frm);
+    std::cerr << "[field] probe: " << fp.frames << " picture(s), " << fp.interlaced << " interlaced ("
+              << fp.tff << " TFF), stream says " << field_order_name(vdecCtx->field_order) << "\n";
+    return field_probe_result(fp);
+}
+
+struct Deinterlacer {
+    bool enabled = false;
+    std::string filter = "bwdif";
+    AVFilterGraph* graph = nullptr;
+    AVFilterContext* src = nullptr;
+    AVFilterContext* sink = nullptr;
+    AVFrame* out = nullptr;
+    uint64_t frames = 0, errors = 0;
+    int64_t busy_us = 0;
+};
+
+static bool deint_init(Deinterlacer& d, const std::string& filter, int w, int h, AVPixelFormat fmt,
+                       AVRational tb, AVRational sar, AVRational frame_rate, int threads) {
+    const AVFilter* fsrc = avfilter_get_by_name("buffer");
+    const AVFilter* fsink = avfilter_get_by_name("buffersink");
+    const AVFilter* fdeint = avfilter_get_by_name(filter.c_str());
+    if (!fsrc || !fsink || !fdeint) return false;
+    d.filter = filter;
+    d.graph = avfilter_graph_alloc();
+    d.out = av_frame_alloc();
+    if (!d.graph || !d.out) return false;
+    d.graph->nb_threads = std::max(1, threads);   // slice threads inside yadif/bwdif
+
+    char args[256];
+    std::snprintf(args, sizeof(args), "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d:frame_rate=%d/%d",
+                  w, h, (int)fmt, tb.num, tb.den, sar.num ? sar.num : 1, sar.den ? sar.den : 1,
+                  frame_rate.num, frame_rate.den ? frame_rate.den : 1);
+    AVFilterContext* deint = nullptr;
+    if (avfilter_graph_create_filter(&d.src, fsrc, "in", args, nullptr, d.graph) < 0) return false;
+    if (avfilter_graph_create_filter(&deint, fdeint, filter.c_str(), "mode=send_frame:parity=auto:deint=interlaced",
+                                     nullptr, d.graph) < 0) return false;
+    if (avfilter_graph_create_filter(&d.sink, fsink, "out", nullptr, nullptr, d.graph) < 0) return false;
+    if (avfilter_link(d.src, 0, deint, 0) < 0 || avfilter_link(deint, 0, d.sink, 0) < 0) return false;
+    if (avfilter_graph_config(d.graph, nullptr) < 0) return false;
+    d.enabled = true;
+    return true;
+}
+
+// f keeps its reference; nullptr flushes the filter at end of input.
+static bool deint_push(Deinterlacer& d, AVFrame* f) {
+    int64_t t0 = av_gettime_relative();
+    int ret = av_buffersrc_add_frame_flags(d.src, f, f ? AV_BUFFERSRC_FLAG_KEEP_REF : 0);
+    d.busy_us += av_gettime_relative() - t0;
+    if (ret < 0) { ++d.errors; return false; }
+    return true;
+}
+
+// Returns d.out (caller unrefs it) or nullptr when the filter needs more input.
+static AVFrame* deint_pull(Deinterlacer& d) {
+    int64_t t0 = av_gettime_relative();
+    int ret = av_buffersink_get_frame(d.sink, d.out);
+    d.busy_us += av_gettime_relative() - t0;
+    if (ret < 0) return nullptr;
+    ++d.frames;
+    return d.out;
+}
+
+static void deint_close(Deinterlacer& d) {
+    if (d.enabled)
+        std::cerr << "[field] " << d.filter << ": frames=" << d.frames << " errors=" << d.errors << " avg="
+                  << (d.frames ? (double)d.busy_us / d.frames / 1000.0 : 0.0) << " ms/frame\n";
+    avfilter_graph_free(&d.graph);
+    av_frame_free(&d.out);
+    d.enabled = false;
+}
+
+// ======================================================================================
+// Video delay line (pooled frame ring between decode and encode)
+// ======================================================================================
+//
+// Holds decoded pictures for --video_delay_ms so late captions (STT runs seconds behind the
+// speech) can still be attached at their target PTS. Every slot is allocated once, so N seconds
+// of video cost exactly N*fps picture buffers; frames are copied in rather than referenced, which
+// keeps the decoder's own buffer pool at its normal size. Encoded audio is held back to match.
+
+struct FrameDelay {
+    std::vector<AVFrame*> slots;
+    size_t head = 0, count = 0;
+    int64_t delay_ticks = 0;                 // encoder time base
+    int64_t newest_pts = AV_NOPTS_VALUE;
+    bool enabled = false;
+    uint64_t forced = 0;                     // released early because the ring was full
+    uint64_t realloc = 0;                    // slot rebuilt for a new size/format
+    std::deque<AVPacket*> audio;             // encoded audio waiting for its video
+    std::vector<AVPacket*> spare_audio;      // released packet shells, reused by the next hold
+};
+
+static bool frame_slot_alloc(AVFrame* f, int w, int h, int fmt) {
+    av_frame_unref(f);
+    f->width = w; f->height = h; f->format = fmt;
+    return av_frame_get_buffer(f, 0) == 0;
+}
+
+static bool frame_delay_init(FrameDelay& fd, int delay_ms, int w, int h, int fmt,
+                             AVRational enc_tb, AVRational frame_rate) {
+    if (delay_ms <= 0) return false;
+    double fps = frame_rate.num ? av_q2d(frame_rate) : 30.0;
+    size_t n = (size_t)(delay_ms / 1000.0 * fps + 0.999) + 1;
+    fd.slots.reserve(n);
+    for (size_t i = 0; i < n; ++i) {
+        AVFrame* f = av_frame_alloc();
+        if (!f || !frame_slot_alloc(f, w, h, fmt)) { av_frame_free(&f); break; }
+        fd.slots.push_back(f);
+    }
+    if (fd.slots.size() != n) {
+        for (AVFrame*& f : fd.slots) av_frame_free(&f);
+        fd.slots.clear();
+        return false;
+    }
+    fd.delay_ticks = av_rescale_q(delay_ms, AVRational{1,1000}, enc_tb);
+    fd.enabled = true;
+    int64_t bytes = (int64_t)n * av_image_get_buffer_size((AVPixelFormat)fmt, w, h, 1);
+    std::cerr << "[delay] " << delay_ms << " ms: " << n << " frames of " << w << "x" << h
+              << " preallocated (" << (bytes >> 20) << " MiB)\n";
+    return true;
+}
+
+static bool frame_delay_full(const FrameDelay& fd) { return fd.count == fd.slots.size(); }
+
+// Copy src into the next free slot (call only when not full).
+static bool frame_delay_push(FrameDelay& fd, const AVFrame* src) {
+    AVFrame* dst = fd.slots[(fd.head + fd.count) % fd.slots.size()];
+    if (dst->width != src->width || dst->height != src->height || dst->format != src->format) {
+        if (!frame_slot_alloc(dst, src->width, src->height, src->format)) return false;
+        ++fd.realloc;
+    } else if (av_frame_make_writable(dst) < 0) {   // encoder may still hold the last use
+        return false;
+    }
+    while (dst->nb_side_data > 0) av_frame_remove_side_data(dst, dst->side_data[0]->type);
+    av_dict_free(&dst->metadata);
+    if (av_frame_copy(dst, src) < 0 || av_frame_copy_props(dst, src) < 0) return false;
+    ++fd.count;
+    if (src->pts != AV_NOPTS_VALUE) fd.newest_pts = src->pts;
+    return true;
+}
+
+// Oldest frame once it has waited delay_ticks (or unconditionally when flushing).
+// The slot stays owned by the ring; it is recycled after the next pop.
+static AVFrame* frame_delay_pop(FrameDelay& fd, bool flush) {
+    if (fd.count == 0) return nullptr;
+    AVFrame* f = fd.slots[fd.head];
+    bool due = flush || (f->pts != AV_NOPTS_VALUE && fd.newest_pts != AV_NOPTS_VALUE &&
+                         fd.newest_pts - f->pts >= fd.delay_ticks);
+    if (!due) return nullptr;
+    fd.head = (fd.head + 1) % fd.slots.size();
+    --fd.count;
+    return f;
+}
+
+// Takes over pkt's reference (pkt is left blank). False if no shell could be allocated.
+static bool frame_delay_hold_audio(FrameDelay& fd, AVPacket* pkt) {
+    AVPacket* held = nullptr;
+    if (!fd.spare_audio.empty()) { held = fd.spare_audio.back(); fd.spare_audio.pop_back(); }
+    else held = av_packet_alloc();
+    if (!held) return false;
+    av_packet_move_ref(held, pkt);
+    fd.audio.push_back(held);
+    return true;
+}
+
+static void frame_delay_release_audio(FrameDelay& fd) {
+    AVPacket* p = fd.audio.front();
+    fd.audio.pop_front();
+    av_packet_unref(p);
+    fd.spare_audio.push_back(p);
+}
+
+static void frame_delay_free(FrameDelay& fd) {
+    if (fd.enabled)
+        std::cerr << "[delay] forced=" << fd.forced << " realloc=" << fd.realloc << "\n";
+    for (AVFrame*& f : fd.slots) av_frame_free(&f);
+    fd.slots.clear();
+    for (AVPacket*& p : fd.audio) av_packet_free(&p);
+    fd.audio.clear();
+    for (AVPacket*& p : fd.spare_audio) av_packet_free(&p);
+    fd.spare_audio.clear();
+    fd.enabled = false;
+}
+
+// ======================================================================================
+// In-process caption source plugins (C ABI in cc_plugin.h, loaded with dlopen)
+// ======================================================================================
+//
+// push_caption() may be called from any plugin thread: producers serialize on a mutex only to
+// claim a slot in the SPSC ring, and the frame loop drains it lock-free into the scheduler.
+
+struct CaptionPlugin {
+    std::string path;
+    void* dl = nullptr;
+    const cc_plugin* api = nullptr;
+    void* inst = nullptr;
+    cc_plugin_host host{};
+    bool started = false;
+
+    SpscRing<CaptionSegment> queue{1024};
+    std::mutex push_mu;
+    std::atomic<uint64_t> pushed{0}, rejected{0};
+};
+
+static int cc_plugin_host_push(void* host_ctx, const cc_caption_event* ev) {
+    CaptionPlugin* pl = (CaptionPlugin*)host_ctx;
+    if (!ev || ev->struct_size < offsetof(cc_caption_event, seq) + sizeof(ev->seq) || !ev->text) {
+        pl->rejected.fetch_add(1, std::memory_order_relaxed);
+        return -1;
+    }
+    CaptionSegment seg;
+    seg.text     = sanitize_caption_text(ev->text, 1024);
+    seg.start_s  = ev->start_s;
+    seg.end_s    = ev->end_s;
+    seg.dur_s    = ev->dur_s;
+    seg.priority = std::min(std::max((int)ev->priority, 0), 2);
+    seg.seq      = ev->seq;
+    if (seg.text.empty()) { pl->rejected.fetch_add(1, std::memory_order_relaxed); return -1; }
+
+    std::lock_guard<std::mutex> lk(pl->push_mu);
+    if (!pl->queue.push(std::move(seg))) { pl->rejected.fetch_add(1, std::memory_order_relaxed); return -1; }
+    pl->pushed.fetch_add(1, std::memory_order_relaxed);
+    return 0;
+}
+
+static void cc_plugin_host_log(void* host_ctx, const char* msg) {
+    CaptionPlugin* pl = (CaptionPlugin*)host_ctx;
+    std::cerr << "[plugin " << (pl->api && pl->api->name ? pl->api->name : "?") << "] " << (msg ? msg : "") << "\n";
+}
+
+static bool cc_plugin_load(CaptionPlugin& pl, const std::string& path, const std::string& args) {
+    pl.path = path;
+    pl.dl = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (!pl.dl) { std::cerr << "[plugin] dlopen failed: " << dlerror() << "\n"; return false; }
+
+    cc_plugin_entry_fn entry = (cc_plugin_entry_fn)dlsym(pl.dl, CC_PLUGIN_ENTRY_SYMBOL);
+    pl.api = entry ? entry(CC_PLUGIN_ABI_VERSION) : nullptr;
+    if (!pl.api || pl.api->abi_version != CC_PLUGIN_ABI_VERSION || !pl.api->create || !pl.api->start) {
+        std::cerr << "[plugin] " << path << ": missing entry point or ABI mismatch\n";
+        dlclose(pl.dl); pl.dl = nullptr; pl.api = nullptr;
+        return false;
+    }
+
+    pl.host.abi_version  = CC_PLUGIN_ABI_VERSION;
+    pl.host.host_ctx     = &pl;
+    pl.host.push_caption = cc_plugin_host_push;
+    pl.host.log          = cc_plugin_host_log;
+
+    pl.inst = pl.api->create(&pl.host, args.c_str());
+    if (!pl.inst) { std::cerr << "[plugin] " << path << ": create() failed\n"; dlclose(pl.dl); pl.dl = nullptr; return false; }
+    if (pl.api->start(pl.inst) != 0) {
+        std::cerr << "[plugin] " << path << ": start() failed\n";
+        if (pl.api->destroy) pl.api->destroy(pl.inst);
+        dlclose(pl.dl); pl.dl = nullptr; pl.inst = nullptr;
+        return false;
+    }
+    pl.started = true;
+    std::cerr << "[plugin] loaded " << (pl.api->name ? pl.api->name : path) << " from " << path
+              << (pl.api->on_audio ? " (audio)" : "") << "\n";
+    return true;
+}
+
+static inline bool cc_plugin_wants_audio(const CaptionPlugin& pl) {
+    return pl.started && pl.api->on_audio;
+}
+
+static bool cc_plugin_drain(CaptionPlugin& pl, std::vector<CaptionSegment>& out) {
+    bool got = false;
+    CaptionSegment seg;
+    while (pl.queue.pop(seg)) { out.push_back(std::move(seg)); got = true; }
+    return got;
+}
+
+static void cc_plugin_unload(CaptionPlugin& pl) {
+    if (!pl.dl) return;
+    if (pl.started && pl.api->stop) pl.api->stop(pl.inst);
+    if (pl.inst && pl.api->destroy) pl.api->destroy(pl.inst);
+    std::cerr << "[plugin] " << (pl.api->name ? pl.api->name : pl.path) << ": pushed=" << pl.pushed.load()
+              << " rejected=" << pl.rejected.load() << "\n";
+    dlclose(pl.dl);
+    pl.dl = nullptr; pl.api = nullptr; pl.inst = nullptr; pl.started = false;
+}
+
+// ======================================================================================
+// Video encoder setup + adaptive preset controller
+// ======================================================================================
+
+struct VencConfig {
+    std::string preset;          // libx264/libx265 preset; empty = encoder default
+    bool low_latency = false;    // --latency=low
+    int bframes = 0;             // consecutive B-frames (libx264 / mpeg2video)
+    int64_t maxrate = 0;         // bits/s VBV; one frame of it with low_latency, else one second
+    int width = 0, height = 0;   // 0 = decoder size
+    AVPixelFormat pix_fmt = AV_PIX_FMT_NONE;   // NONE = decoder format
+    AVFieldOrder field_order = AV_FIELD_PROGRESSIVE;   // TT/BB: interlaced coding
+    int threads = 0;             // libx265 worker pool size (x265 "pools"); 0 = all cores
+};
+
+// vdecCtx may be null when cfg carries the size and pixel format (warm start).
+static AVCodecContext* open_video_encoder(const AVCodec* venc, const AVCodecContext* vdecCtx,
+                                          AVRational in_rate, const VencConfig& cfg) {
+    AVCodecContext* c = avcodec_alloc_context3(venc);
+    if (!c) return nullptr;
+    const bool x265 = std::strcmp(venc->name, "libx265") == 0;
+    std::string x265_params;     // libx265 takes its thread pool and low-latency knobs here
+    if (x265 && cfg.threads > 0) x265_params = "pools=" + std::to_string(cfg.threads);
+    const int dec_w = vdecCtx ? vdecCtx->width : 0, dec_h = vdecCtx ? vdecCtx->height : 0;
+    const AVPixelFormat dec_pix = vdecCtx ? (AVPixelFormat)vdecCtx->pix_fmt : AV_PIX_FMT_NONE;
+    c->width   = cfg.width  ? cfg.width  : dec_w ? dec_w : 1280;
+    c->height  = cfg.height ? cfg.height : dec_h ? dec_h : 720;
+    c->pix_fmt = cfg.pix_fmt != AV_PIX_FMT_NONE ? cfg.pix_fmt
+               : dec_pix == AV_PIX_FMT_NONE ? AV_PIX_FMT_YUV420P : dec_pix;
+    c->time_base = av_inv_q(in_rate);
+    c->framerate = in_rate;
+    c->gop_size  = 30;
+    c->max_b_frames = cfg.low_latency ? 0 : std::max(cfg.bframes, 0);
+
+    if (!cfg.preset.empty()) av_opt_set(c->priv_data, "preset", cfg.preset.c_str(), 0);
+    if (cfg.low_latency) {
+        // No lookahead or frame threads; a rolling intra column replaces IDR spikes, and a
+        // one-frame VBV keeps every frame's bits deliverable within its own interval.
+        c->flags |= AV_CODEC_FLAG_LOW_DELAY;
+        c->thread_type = FF_THREAD_SLICE;
+        av_opt_set(c->priv_data, "tune", "zerolatency", 0);
+        if (x265) {
+            x265_params += std::string(x265_params.empty() ? "" : ":") + "frame-threads=1:rc-lookahead=0:intra-refresh=1";
+        } else {
+            av_opt_set(c->priv_data, "intra-refresh", "1", 0);
+            av_opt_set(c->priv_data, "x264-params", "sliced-threads=1:sync-lookahead=0:rc-lookahead=0", 0);
+        }
+        if (cfg.maxrate > 0) {
+            c->rc_max_rate = cfg.maxrate;
+            c->rc_buffer_size = (int)std::max<int64_t>(1, av_rescale_q(cfg.maxrate, av_inv_q(in_rate), AVRational{1,1}));
+        }
+    } else if (cfg.maxrate > 0) {
+        // Capped for a CBR mux: peaks may use a second of buffer but never exceed the rate
+        c->rc_max_rate = cfg.maxrate;
+        c->rc_buffer_size = (int)std::min<int64_t>(cfg.maxrate, INT32_MAX);
+    }
+    if (cfg.field_order == AV_FIELD_TT || cfg.field_order == AV_FIELD_BB) {
+        // libx264 codes MBAFF and follows each picture's field order; mpeg2video uses field DCT/ME
+        c->flags |= AV_CODEC_FLAG_INTERLACED_DCT | AV_CODEC_FLAG_INTERLACED_ME;
+        c->field_order = cfg.field_order;
+    }
+    if (!x265_params.empty()) av_opt_set(c->priv_data, "x265-params", x265_params.c_str(), 0);
+    // Encourage A/53 captions in libx26x wrappers (no-op if option absent)
+    if (av_opt_set(c->priv_data, "a53cc", "1", 0) < 0 && x265)
+        std::cerr << "[venc] this libx265 wrapper has no a53cc option; captions will not reach the output\n";
+    // Keyframes the frame loop forces at GOP starts are IDRs (HLS segments start on them)
+    av_opt_set(c->priv_data, "forced-idr", "1", 0);
+
+    if (avcodec_open2(c, venc, nullptr) < 0) { avcodec_free_context(&c); return nullptr; }
+    return c;
+}
+
+// libx264 cannot change its preset on an open encoder (libavcodec only reconfigures bitrate,
+// CRF and VBV at runtime), so the controller swaps in a freshly opened encoder at a GOP boundary.
+// In MPEG-TS that is seamless: the new encoder starts with an IDR carrying SPS/PPS in-band.
+//
+// Load is the smoothed time spent in avcodec_send_frame/receive_packet per frame divided by the
+// frame interval. Above (1 - margin), or when a GOP took longer in wall time than it lasts
+// (input backing up), step one preset faster. Only after three GOPs below half that budget step
+// one slower, and not back to a preset that was just too slow for 30 GOPs (no oscillation).
+// Two GOPs after a change are ignored while the new encoder fills its lookahead.
+
+static const char* const kX264Presets[] = {
+    "ultrafast", "superfast", "veryfast", "faster", "fast", "medium", "slow", "slower",
+};
+static const int kX264PresetCount = (int)(sizeof(kX264Presets) / sizeof(kX264Presets[0]));
+
+static int x264_preset_index(const std::string& name) {
+    for (int i = 0; i < kX264PresetCount; ++i) if (name == kX264Presets[i]) return i;
+    return -1;
+}
+
+struct PresetController {
+    bool enabled = false;
+    int idx = 5;                 // medium
+    int max_idx = 6;             // never slower than "slow"
+    double frame_ms = 33.3;
+    double margin = 0.2;
+    double ewma_ms = 0.0;
+    int64_t gop_frames = 0, gop_start_us = 0;
+    int calm_gops = 0, settle_gops = 1;
+    int ceiling_idx = 0, ceiling_gops = 0;   // temporary cap after stepping faster
+    uint64_t changes = 0;
+};
+
+static void preset_ctl_init(PresetController& pc, int idx, AVRational frame_rate, int margin_pct) {
+    pc.enabled = idx >= 0;
+    pc.idx = std::max(idx, 0);
+    pc.max_idx = std::max(pc.idx, 6);
+    pc.frame_ms = 1000.0 / (frame_rate.num ? av_q2d(frame_rate) : 30.0);
+    pc.margin = std::min(std::max(margin_pct, 0), 90) / 100.0;
+}
+
+static void preset_ctl_sample(PresetController& pc, int64_t encode_us) {
+    double ms = encode_us / 1000.0;
+    pc.ewma_ms = pc.ewma_ms <= 0.0 ? ms : pc.ewma_ms + 0.1 * (ms - pc.ewma_ms);
+    ++pc.gop_frames;
+}
+
+// Called at each GOP boundary; returns the preset index to switch to, or -1 to stay.
+static int preset_ctl_decide(PresetController& pc, int64_t now_us) {
+    double wall_ms = (now_us - pc.gop_start_us) / 1000.0;
+    double media_ms = pc.gop_frames * pc.frame_ms;
+    bool first = pc.gop_start_us == 0;
+    pc.gop_start_us = now_us;
+    pc.gop_frames = 0;
+    if (first || pc.settle_gops > 0) { if (!first) --pc.settle_gops; return -1; }
+    if (pc.ceiling_gops > 0) --pc.ceiling_gops;
+    const int limit = pc.ceiling_gops > 0 ? pc.ceiling_idx : pc.max_idx;
+
+    double load = pc.ewma_ms / pc.frame_ms;
+    double high = 1.0 - pc.margin;
+    bool slipping = media_ms > 0.0 && wall_ms > media_ms * 1.02;
+    int next = -1;
+    if ((load > high || slipping) && pc.idx > 0) {
+        next = pc.idx - 1;
+    } else if (load < high * 0.5 && !slipping) {
+        if (++pc.calm_gops >= 3 && pc.idx < limit) next = pc.idx + 1;
+    } else {
+        pc.calm_gops = 0;
+    }
+    if (next < 0) return -1;
+
+    std::cerr << "[rc] preset " << kX264Presets[pc.idx] << " -> " << kX264Presets[next]
+              << " (encode " << pc.ewma_ms << " ms/frame, budget " << pc.frame_ms * high
+              << " ms, gop " << wall_ms << " ms wall / " << media_ms << " ms media)\n";
+    if (next < pc.idx) { pc.ceiling_idx = next; pc.ceiling_gops = 30; }
+    pc.idx = next;
+    pc.calm_gops = 0;
+    pc.settle_gops = 2;
+    ++pc.changes;
+    return next;
+}
+
+// The replaced encoder is flushed on a helper thread. Draining x264's lookahead and frame
+// threads takes several frame times, and the controller swaps exactly when the host is behind
+// real time. The new encoder takes frames meanwhile. Its packets are held back until the old
+// encoder's last packet is out, so the muxer still sees one decode-ordered stream.
+struct EncoderDrain {
+    AVCodecContext* ctx = nullptr;
+    std::vector<AVPacket*> pkts;         // in ctx->time_base
+    std::atomic<bool> done{false};
+    std::thread worker;
+
+    ~EncoderDrain() {                    // early exits; the frame loop collects it normally
+        if (worker.joinable()) worker.join();
+        for (AVPacket*& p : pkts) av_packet_free(&p);
+        avcodec_free_context(&ctx);
+    }
+};
+
+static void encoder_drain_thread(EncoderDrain* d) {
+    avcodec_send_frame(d->ctx, nullptr);
+    for (;;) {
+        AVPacket* p = av_packet_alloc();
+        if (!p || avcodec_receive_packet(d->ctx, p) != 0) { av_packet_free(&p); break; }
+        d->pkts.push_back(p);
+    }
+    d->done = true;
+}
+
+static void encoder_drain_start(EncoderDrain& d, AVCodecContext* old_ctx) {
+    d.ctx = old_ctx;
+    d.done = false;
+    d.worker = std::thread(encoder_drain_thread, &d);
+}
+
+// The replacement encoder is opened on a helper thread too: x264 allocates its lookahead and
+// frame threads in avcodec_open2, which costs several frame times at 1080p. The frame loop keeps
+// encoding with the current preset and adopts the new encoder at the first GOP boundary after
+// the open has finished.
+struct EncoderOpen {
+    const AVCodec* codec = nullptr;
+    AVRational rate{0, 1};
+    VencConfig cfg;                      // size and pixel format pinned, no decoder needed
+    AVCodecContext* ctx = nullptr;       // null after a failed open
+    std::atomic<bool> done{false};
+    std::thread worker;
+
+    ~EncoderOpen() {
+        if (worker.joinable()) worker.join();
+        avcodec_free_context(&ctx);
+    }
+};
+
+static void encoder_open_thread(EncoderOpen* o) {
+    o->ctx = open_video_encoder(o->codec, nullptr, o->rate, o->cfg);
+    o->done = true;
+}
+
+static void encoder_open_start(EncoderOpen& o, const AVCodec* codec, AVRational rate, const VencConfig& cfg) {
+    o.codec = codec;
+    o.rate = rate;
+    o.cfg = cfg;
+    o.ctx = nullptr;
+    o.done = false;
+    o.worker = std::thread(encoder_open_thread, &o);
+}
+
+// Encoder throughput, for every backend: time spent in send_frame/receive_packet per frame
+// against the frame interval, speed relative to real time, and output bitrate.
+struct EncodeStats {
+    uint64_t frames = 0, bytes = 0;
+    int64_t busy_us = 0, max_us = 0;
+    double frame_ms = 33.3;
+};
+
+static void enc_stats_frame(EncodeStats& es, int64_t us) {
+    ++es.frames;
+    es.busy_us += us;
+    es.max_us = std::max(es.max_us, us);
+}
+
+static void enc_stats_report(const EncodeStats& es, const char* codec, const std::string& preset, const char* when) {
+    if (!es.frames) return;
+    double avg_ms = es.busy_us / 1000.0 / es.frames;
+    double media_s = es.frames * es.frame_ms / 1000.0;
+    std::cerr << "[venc] " << when << " " << codec << (preset.empty() ? "" : " ") << preset
+              << ": frames=" << es.frames << " encode avg=" << avg_ms << "ms max=" << es.max_us / 1000.0
+              << "ms (" << (int)(100.0 * avg_ms / es.frame_ms) << "% of the frame interval, "
+              << (avg_ms > 0 ? es.frame_ms / avg_ms : 0.0) << "x real time) bitrate="
+              << (media_s > 0 ? es.bytes * 8.0 / media_s / 1000.0 : 0.0) << " kbit/s\n";
+}
+
+// ======================================================================================
+// Warm start (encoder opened from cached parameters while the input is probed)
+// ======================================================================================
+//
+// Startup used to be strictly serial: open input, find_stream_info, open decoder, open encoder,
+// open output, write header. With --warm_cache=PATH the encoder configuration resolved on the
+// previous run (after probing) is saved to PATH. On the next start a thread opens that encoder
+// while the main thread opens and probes the input; only the encoder open runs in parallel.
+// The same thread also allocates the muxer context, which costs next to nothing. The AVIO is
+// opened only after the probe has succeeded, so a bad input never truncates the previous output
+// file. If the configuration derived from the probe is identical, the warm encoder is used as
+// is; otherwise it is dropped and the encoder is reopened with the probed values (and the cache
+// rewritten). Startup milestones are logged up to the first packet carrying captions.
+
+struct WarmStart {
+    bool enabled = false;
+    std::string path;
+    bool cached = false;                 // cache file read
+    std::string venc_name;
+    VencConfig cfg;
+    AVRational rate{0, 1};
+
+    std::thread thread;
+    AVCodecContext* enc = nullptr;       // opened from the cache (owned until adopted)
+    AVFormatContext* ofmt = nullptr;     // output with pb open (owned until adopted)
+    int64_t enc_us = 0, out_us = 0;      // time the thread spent on each
+
+    ~WarmStart() { if (thread.joinable()) thread.join(); }
+};
+
+static void startup_mark(int64_t t0_us, const char* what) {
+    std::cerr << "[startup] " << what << " +" << (av_gettime_relative() - t0_us) / 1000.0 << " ms\n";
+}
+
+static bool venc_config_equal(const VencConfig& a, const VencConfig& b) {
+    return a.preset == b.preset && a.low_latency == b.low_latency && a.bframes == b.bframes &&
+           a.maxrate == b.maxrate && a.width == b.width && a.height == b.height && a.pix_fmt == b.pix_fmt &&
+           a.field_order == b.field_order && a.threads == b.threads;
+}
+
+// One "key=value" per line; unknown keys are ignored so the format can grow.
+static bool warm_cache_load(WarmStart& ws) {
+    std::FILE* f = std::fopen(ws.path.c_str(), "r");
+    if (!f) return false;
+    char line[512], val[256];
+    int fields = 0;
+    while (std::fgets(line, sizeof(line), f)) {
+        long long n = 0;
+        int a = 0, b = 0;
+        if (std::sscanf(line, "venc=%255s", val) == 1)             { ws.venc_name = val; ++fields; }
+        else if (std::sscanf(line, "preset=%255s", val) == 1)      ws.cfg.preset = val;
+        else if (std::sscanf(line, "width=%d", &a) == 1)           { ws.cfg.width = a; ++fields; }
+        else if (std::sscanf(line, "height=%d", &a) == 1)          { ws.cfg.height = a; ++fields; }
+        else if (std::sscanf(line, "pix_fmt=%255s", val) == 1)     ws.cfg.pix_fmt = av_get_pix_fmt(val);
+        else if (std::sscanf(line, "rate=%d/%d", &a, &b) == 2)     { ws.rate = AVRational{a, b}; ++fields; }
+        else if (std::sscanf(line, "low_latency=%d", &a) == 1)     ws.cfg.low_latency = a != 0;
+        else if (std::sscanf(line, "bframes=%d", &a) == 1)         ws.cfg.bframes = a;
+        else if (std::sscanf(line, "maxrate=%lld", &n) == 1)       ws.cfg.maxrate = n;
+        else if (std::sscanf(line, "field_order=%d", &a) == 1)     ws.cfg.field_order = (AVFieldOrder)a;
+        else if (std::sscanf(line, "threads=%d", &a) == 1)         ws.cfg.threads = a;
+    }
+    std::fclose(f);
+    return fields == 4 && ws.rate.num > 0 && ws.rate.den > 0 && ws.cfg.width > 0 && ws.cfg.height > 0;
+}
+
+static void warm_cache_save(const std::string& path, const char* venc_name, const VencConfig& c, AVRational rate) {
+    std::string tmp = path + ".tmp";
+    std::FILE* f = std::fopen(tmp.c_str(), "w");
+    if (!f) { std::cerr << "[startup] cannot write warm cache " << path << "\n"; return; }
+    const char* pix = c.pix_fmt != AV_PIX_FMT_NONE ? av_get_pix_fmt_name(c.pix_fmt) : nullptr;
+    std::fprintf(f, "venc=%s\n", venc_name);
+    if (!c.preset.empty()) std::fprintf(f, "preset=%s\n", c.preset.c_str());
+    std::fprintf(f, "width=%d\nheight=%d\n", c.width, c.height);
+    if (pix) std::fprintf(f, "pix_fmt=%s\n", pix);
+    std::fprintf(f, "rate=%d/%d\nlow_latency=%d\nbframes=%d\nmaxrate=%lld\nfield_order=%d\nthreads=%d\n",
+                 rate.num, rate.den, c.low_latency ? 1 : 0, c.bframes, (long long)c.maxrate, (int)c.field_order, c.threads);
+    bool ok = std::fclose(f) == 0;
+    if (!ok || std::rename(tmp.c_str(), path.c_str()) != 0) std::cerr << "[startup] cannot write warm cache " << path << "\n";
+}
+
+static void warm_start_thread(WarmStart* ws, std::string out_url) {
+    int64_t t0 = av_gettime_relative();
+    if (ws->cached) {
+        const AVCodec* codec = avcodec_find_encoder_by_name(ws->venc_name.c_str());
+        if (codec) ws->enc = open_video_encoder(codec, nullptr, ws->rate, ws->cfg);
+    }
+    int64_t t1 = av_gettime_relative();
+    ws->enc_us = t1 - t0;
+
+    // Muxer context only: avio_open would truncate the output before the input is known to be good
+    if (avformat_alloc_output_context2(&ws->ofmt, nullptr, "mpegts", out_url.c_str()) < 0) ws->ofmt = nullptr;
+    ws->out_us = av_gettime_relative() - t1;
+}
+
+static void warm_start_begin(WarmStart& ws, const std::string& path, const char* out_url) {
+    ws.enabled = true;
+    ws.path = path;
+    ws.cached = warm_cache_load(ws);
+    std::cerr << "[startup] warm cache " << path << ": "
+              << (ws.cached ? ws.venc_name + " " + std::to_string(ws.cfg.width) + "x" + std::to_string(ws.cfg.height)
+                            : std::string("none (opening the output only)")) << "\n";
+    ws.thread = std::thread(warm_start_thread, &ws, std::string(out_url));
+}
+
+// Hands over the warm encoder if it was opened with exactly this configuration (else frees it).
+static AVCodecContext* warm_start_take_encoder(WarmStart& ws, const char* venc_name, const VencConfig& cfg, AVRational rate) {
+    if (ws.thread.joinable()) ws.thread.join();
+    AVCodecContext* enc = ws.enc;
+    ws.enc = nullptr;
+    if (!enc) return nullptr;
+    if (ws.venc_name == venc_name && av_cmp_q(ws.rate, rate) == 0 && venc_config_equal(ws.cfg, cfg)) {
+        std::cerr << "[startup] probe matches the warm cache; encoder opened in parallel (" << ws.enc_us / 1000.0 << " ms saved)\n";
+        return enc;
+    }
+    std::cerr << "[startup] probe differs from the warm cache (" << cfg.width << "x" << cfg.height << " @ "
+              << av_q2d(rate) << " vs " << ws.cfg.width << "x" << ws.cfg.height << " @ " << av_q2d(ws.rate)
+              << "); reopening the encoder\n";
+    avcodec_free_context(&enc);
+    return nullptr;
+}
+
+static AVFormatContext* warm_start_take_output(WarmStart& ws) {
+    if (ws.thread.joinable()) ws.thread.join();
+    AVFormatContext* o = ws.ofmt;
+    ws.ofmt = nullptr;
+    return o;
+}
+
+// Frees whatever was not adopted (early exits).
+static void warm_start_close(WarmStart& ws) {
+    if (ws.thread.joinable()) ws.thread.join();
+    avcodec_free_context(&ws.enc);
+    if (ws.ofmt) {
+        if (!(ws.ofmt->oformat->flags & AVFMT_NOFILE)) avio_closep(&ws.ofmt->pb);
+        avformat_free_context(ws.ofmt);
+        ws.ofmt = nullptr;
+    }
+}
+
+// ======================================================================================
+// ABR ladder (one decode -> N scaled renditions, each with its own encoder and output)
+// ======================================================================================
+//
+// The frame loop attaches cc_data once, then hands every rung a reference to the same picture
+// (av_frame_clone: no pixel copy, and the A53_CC side data buffer is shared, not duplicated).
+// Each rung's worker thread scales with its own multi-threaded swscale context, encodes and muxes,
+// so rungs run in parallel with the main encoder. Every rendition gets the identical cc_data
+// on the identical PTS. Encoded audio packets go through the same queue, so each worker writes
+// its output in order. The queues are bounded: a slow rung back-pressures the frame loop instead
+// of buffering without limit. The queue is a fixed ring, job frames/packets are recycled shells,
+// and scaled pictures come from the rung's PlanePool, so a running rung allocates nothing.
+
+struct LadderJob {
+    AVFrame* frame = nullptr;    // picture to scale + encode (shell owned by the job)
+    AVPacket* audio = nullptr;   // encoded audio in the main output's audio time base (shell)
+    bool eof = false;
+};
+
+struct LadderRung {
+    int width = 0, height = 0;
+    std::string url;
+    SwsContext* sws = nullptr;
+    AVCodecContext* enc = nullptr;
+    AVFormatContext* ofmt = nullptr;
+    AVStream* vst = nullptr;
+    AVStream* ast = nullptr;
+    AVRational audio_tb{1,1};
+    PlanePool planes;
+    AVFrame* dst = nullptr;              // scaled picture (worker only)
+
+    std::vector<LadderJob> ring;         // max_jobs slots
+    size_t head = 0, count = 0;
+    size_t max_jobs = 8;
+    std::vector<AVFrame*> spare_frames;  // unreferenced job shells, guarded by mu
+    std::vector<AVPacket*> spare_pkts;
+    std::mutex mu;
+    std::condition_variable cv;
+    std::thread worker;
+
+    uint64_t frames = 0, packets = 0, waits = 0, errors = 0;
+};
+
+// "out_%d.ts" -> "out_720.ts"; without %d the height is appended before the extension.
+static std::string ladder_rung_url(const std::string& tmpl, int height) {
+    size_t p = tmpl.find("%d");
+    if (p != std::string::npos) return tmpl.substr(0, p) + std::to_string(height) + tmpl.substr(p + 2);
+    size_t dot = tmpl.find_last_of('.');
+    if (dot == std::string::npos || tmpl.find('/', dot) != std::string::npos) return tmpl + "_" + std::to_string(height);
+    return tmpl.substr(0, dot) + "_" + std::to_string(height) + tmpl.substr(dot);
+}
+
+static bool ladder_rung_open(LadderRung& r, const AVCodec* venc, const AVCodecContext* vdecCtx, AVPixelFormat src_fmt, VencConfig cfg,
+                             AVRational in_rate, const AVCodecContext* aencCtx, const AVStream* aout,
+                             bool low_latency, int sws_threads) {
+    const int sw = vdecCtx->width, sh = vdecCtx->height;
+    r.width = std::max(2, (int)((int64_t)sw * r.height / std::max(sh, 1)) & ~1);
+
+    cfg.width = r.width; cfg.height = r.height; cfg.pix_fmt = AV_PIX_FMT_YUV420P;
+    cfg.field_order = AV_FIELD_PROGRESSIVE;     // scaled pictures no longer keep their fields apart
+    if (cfg.threads > 0) cfg.threads = std::max(1, (int)((int64_t)cfg.threads * r.height / std::max(sh, 1)));
+    r.enc = open_video_encoder(venc, vdecCtx, in_rate, cfg);
+    if (!r.enc) return false;
+
+    // Every job in flight (max_jobs queued + one in the worker) can hold a frame or packet shell
+    r.ring.assign(r.max_jobs, LadderJob{});
+    r.spare_frames.reserve(r.max_jobs + 1);
+    r.spare_pkts.reserve(r.max_jobs + 1);
+    r.dst = av_frame_alloc();
+    if (!r.dst || !plane_pool_init(r.planes, r.width, r.height)) return false;
+
+#if LIBSWSCALE_VERSION_INT >= AV_VERSION_INT(6, 1, 100)
+    r.sws = sws_alloc_context();
+    if (!r.sws) return false;
+    av_opt_set_int(r.sws, "srcw", sw, 0);
+    av_opt_set_int(r.sws, "srch", sh, 0);
+    av_opt_set_int(r.sws, "src_format", src_fmt, 0);
+    av_opt_set_int(r.sws, "dstw", r.width, 0);
+    av_opt_set_int(r.sws, "dsth", r.height, 0);
+    av_opt_set_int(r.sws, "dst_format", AV_PIX_FMT_YUV420P, 0);
+    av_opt_set_int(r.sws, "sws_flags", SWS_BICUBIC, 0);
+    av_opt_set_int(r.sws, "threads", sws_threads, 0);
+    if (sws_init_context(r.sws, nullptr, nullptr) < 0) return false;
+#else
+    (void)sws_threads;
+    r.sws = sws_getContext(sw, sh, src_fmt, r.width, r.height, AV_PIX_FMT_YUV420P,
+                           SWS_BICUBIC, nullptr, nullptr, nullptr);
+    if (!r.sws) return false;
+#endif
+
+    if (avformat_alloc_output_context2(&r.ofmt, nullptr, "mpegts", r.url.c_str()) < 0 || !r.ofmt) return false;
+    r.vst = avformat_new_stream(r.ofmt, venc);
+    if (!r.vst || avcodec_parameters_from_context(r.vst->codecpar, r.enc) < 0) return false;
+    r.vst->time_base = r.enc->time_base;
+    if (aencCtx && aout) {
+        r.ast = avformat_new_stream(r.ofmt, aencCtx->codec);
+        if (!r.ast || avcodec_parameters_from_context(r.ast->codecpar, aencCtx) < 0) return false;
+        r.ast->time_base = aout->time_base;
+        r.audio_tb = aout->time_base;
+    }
+    if (low_latency) r.ofmt->flags |= AVFMT_FLAG_FLUSH_PACKETS;
+    if (!(r.ofmt->oformat->flags & AVFMT_NOFILE) && avio_open(&r.ofmt->pb, r.url.c_str(), AVIO_FLAG_WRITE) < 0) return false;
+    if (avformat_write_header(r.ofmt, nullptr) < 0) return false;
+    return true;
+}
+
+static void ladder_write_packets(LadderRung& r, AVPacket* pkt) {
+    while (avcodec_receive_packet(r.enc, pkt) == 0) {
+        av_packet_rescale_ts(pkt, r.enc->time_base, r.vst->time_base);
+        pkt->stream_index = r.vst->index;
+        if (av_interleaved_write_frame(r.ofmt, pkt) < 0) ++r.errors;
+        ++r.packets;
+        av_packet_unref(pkt);
+    }
+}
+
+static void ladder_scale_encode(LadderRung& r, const AVFrame* src, AVPacket* pkt) {
+    AVFrame* dst = r.dst;
+    bool ok = plane_pool_get(r.planes, dst);
+#if LIBSWSCALE_VERSION_INT >= AV_VERSION_INT(6, 1, 100)
+    ok = ok && sws_scale_frame(r.sws, dst, src) >= 0;
+#else
+    ok = ok && sws_scale(r.sws, src->data, src->linesize, 0, src->height, dst->data, dst->linesize) > 0;
+#endif
+    if (ok) {
+        dst->pts = src->pts;
+        dst->sample_aspect_ratio = src->sample_aspect_ratio;
+        // Same cc_data bytes as every other rendition: reference, don't copy
+        if (const AVFrameSideData* sd = av_frame_get_side_data(src, AV_FRAME_DATA_A53_CC)) {
+            AVBufferRef* ref = sd->buf ? av_buffer_ref(sd->buf) : nullptr;
+            if (ref) ref->size = sd->size;     // pooled buffer is larger than the bytes in use
+            if (!ref || !av_frame_new_side_data_from_buf(dst, AV_FRAME_DATA_A53_CC, ref)) { av_buffer_unref(&ref); ++r.errors; }
+        }
+        if (avcodec_send_frame(r.enc, dst) == 0) { ++r.frames; ladder_write_packets(r, pkt); }
+        else ++r.errors;
+    } else {
+        ++r.errors;
+    }
+    av_frame_unref(dst);
+}
+
+// Job shells cycle between the frame loop and the worker instead of being freed per job.
+static AVFrame* ladder_frame_shell(LadderRung& r) {
+    std::lock_guard<std::mutex> lk(r.mu);
+    if (r.spare_frames.empty()) return av_frame_alloc();
+    AVFrame* f = r.spare_frames.back();
+    r.spare_frames.pop_back();
+    return f;
+}
+
+static AVPacket* ladder_packet_shell(LadderRung& r) {
+    std::lock_guard<std::mutex> lk(r.mu);
+    if (r.spare_pkts.empty()) return av_packet_alloc();
+    AVPacket* p = r.spare_pkts.back();
+    r.spare_pkts.pop_back();
+    return p;
+}
+
+static void ladder_recycle(LadderRung& r, LadderJob& job) {
+    if (job.frame) av_frame_unref(job.frame);
+    if (job.audio) av_packet_unref(job.audio);
+    std::lock_guard<std::mutex> lk(r.mu);
+    if (job.frame) r.spare_frames.push_back(job.frame);
+    if (job.audio) r.spare_pkts.push_back(job.audio);
+    job.frame = nullptr;
+    job.audio = nullptr;
+}
+
+static void ladder_worker(LadderRung* r) {
+    AVPacket* pkt = av_packet_alloc();
+    for (;;) {
+        LadderJob job;
+        {
+            std::unique_lock<std::mutex> lk(r->mu);
+            r->cv.wait(lk, [r] { return r->count > 0; });
+            job = r->ring[r->head];
+            r->ring[r->head] = LadderJob{};
+            r->head = (r->head + 1) % r->ring.size();
+            --r->count;
+        }
+        r->cv.notify_all();
+        if (job.frame) ladder_scale_encode(*r, job.frame, pkt);
+        if (job.audio && r->ast) {
+            av_packet_rescale_ts(job.audio, r->audio_tb, r->ast->time_base);
+            job.audio->stream_index = r->ast->index;
+            if (av_interleaved_write_frame(r->ofmt, job.audio) < 0) ++r->errors;
+        }
+        ladder_recycle(*r, job);
+        if (job.eof) break;
+    }
+    avcodec_send_frame(r->enc, nullptr);
+    ladder_write_packets(*r, pkt);
+    av_write_trailer(r->ofmt);
+    av_packet_free(&pkt);
+}
+
+// Blocks while the rung is max_jobs behind.
+static void ladder_submit(LadderRung& r, LadderJob job) {
+    std::unique_lock<std::mutex> lk(r.mu);
+    if (r.count >= r.ring.size()) {
+        ++r.waits;
+        r.cv.wait(lk, [&r] { return r.count < r.ring.size(); });
+    }
+    r.ring[(r.head + r.count) % r.ring.size()] = job;
+    ++r.count;
+    lk.unlock();
+    r.cv.notify_all();
+}
+
+static void ladder_submit_frame(std::vector<std::unique_ptr<LadderRung>>& ladder, const AVFrame* f) {
+    for (auto& r : ladder) {
+        LadderJob job;
+        job.frame = ladder_frame_shell(*r);
+        if (job.frame && av_frame_ref(job.frame, f) == 0) { ladder_submit(*r, job); continue; }
+        if (job.frame) ladder_recycle(*r, job);
+        ++r->errors;
+    }
+}
+
+static void ladder_submit_audio(std::vector<std::unique_ptr<LadderRung>>& ladder, const AVPacket* pkt) {
+    for (auto& r : ladder) {
+        LadderJob job;
+        job.audio = ladder_packet_shell(*r);
+        if (job.audio && av_packet_ref(job.audio, pkt) == 0) ladder_submit(*r, job);
+        else if (job.audio) ladder_recycle(*r, job);
+    }
+}
+
+static void ladder_close(std::vector<std::unique_ptr<LadderRung>>& ladder) {
+    for (auto& r : ladder) {
+        if (r->worker.joinable()) {
+            LadderJob eof; eof.eof = true;
+            ladder_submit(*r, eof);
+            r->worker.join();
+            std::cerr << "[ladder] " << r->width << "x" << r->height << " -> " << r->url << ": frames=" << r->frames
+                      << " packets=" << r->packets << " queue_waits=" << r->waits << " errors=" << r->errors << "\n";
+        }
+        for (size_t k = 0; k < r->count; ++k) {
+            LadderJob& j = r->ring[(r->head + k) % r->ring.size()];
+            av_frame_free(&j.frame);
+            av_packet_free(&j.audio);
+        }
+        for (AVFrame*& f : r->spare_frames) av_frame_free(&f);
+        for (AVPacket*& p : r->spare_pkts) av_packet_free(&p);
+        av_frame_free(&r->dst);
+        plane_pool_uninit(r->planes);
+        sws_freeContext(r->sws);
+        avcodec_free_context(&r->enc);
+        if (r->ofmt) {
+            if (!(r->ofmt->oformat->flags & AVFMT_NOFILE)) avio_closep(&r->ofmt->pb);
+            avformat_free_context(r->ofmt);
+        }
+    }
+    ladder.clear();
+}
+
+// ======================================================================================
+// LL-HLS / CMAF segmenter (fragmented MP4 parts + playlists, run as a tee destination)
+// ======================================================================================
+//
+// --hls=DIR writes low-latency HLS into DIR. The files are init.mp4, full segments segN.m4s,
+// partial segments segN.P.m4s, index.m3u8 (with EXT-X-PART and EXT-X-PRELOAD-HINT) and
+// master.m3u8. The mp4 muxer runs with frag_custom+delay_moov into a memory AVIOContext. Each
+// part boundary flushes one moof+mdat, which is split by top-level box type: ftyp/moov go to
+// init.mp4 once, the rest is the part. Segments start on IDRs (the frame loop forces one every
+// GOP while --hls is on). A part closes before the first frame that would push it past
+// --hls_part_ms. Captions need no extra track: the 608 cc_data travels in the H.264/HEVC SEI
+// inside the samples, and master.m3u8 declares it as CC1. The segmenter is fed by a tee writer
+// thread, so muxing, file writes and playlist updates all happen off the frame loop. Each part
+// reaches disk (tmp + rename) as soon as the frame after it arrives.
+
+struct HlsPart {
+    double dur = 0.0;
+    bool independent = false;    // starts with an IDR
+};
+
+struct HlsSegment {
+    int64_t msn = 0;             // media sequence number
+    double dur = 0.0;
+    bool complete = false;
+    std::vector<HlsPart> parts;
+};
+
+struct HlsWriter {
+    std::string dir;
+    int64_t seg_us = 2000000, part_us = 333333, frame_us = 33367;
+    int list_size = 6;
+    int target_s = 3;                    // EXT-X-TARGETDURATION (fixed for the playlist's life)
+    AVRational rate{30000, 1001};
+    bool blocking_reload = false;        // the origin answers _HLS_msn/_HLS_part requests
+
+    AVIOContext* pb = nullptr;           // memory sink the mp4 muxer writes into
+    std::vector<uint8_t> chunk;          // bytes written since the last part boundary
+    std::vector<uint8_t> init;           // ftyp + moov
+    bool init_written = false;
+    std::FILE* seg_file = nullptr;       // open segment, as segN.m4s.tmp until complete
+    std::deque<HlsSegment> segs;         // playlist window; back() is the open segment
+    int64_t retired_msn = -1;            // left the playlist; its files go one segment later
+    size_t retired_parts = 0;
+    int64_t seg_start_us = AV_NOPTS_VALUE, part_start_us = AV_NOPTS_VALUE, last_us = AV_NOPTS_VALUE;
+    bool part_independent = false;
+
+    std::string codecs;                  // RFC 6381 "avc1.PPCCLL" from the first SPS (H.264 only)
+    int width = 0, height = 0;
+    bool has_audio = false;
+    bool master_written = false;
+    uint64_t seg_bytes = 0;
+    double peak_bps = 0.0;
+
+    uint64_t parts = 0, segments = 0, bytes = 0, write_errors = 0;
+    int64_t publish_us_sum = 0, publish_us_max = 0;   // fragment flush -> part + playlist on disk
+};
+
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+static int hls_sink_write(void* opaque, const uint8_t* buf, int size) {
+#else
+static int hls_sink_write(void* opaque, uint8_t* buf, int size) {
+#endif
+    HlsWriter* h = (HlsWriter*)opaque;
+    h->chunk.insert(h->chunk.end(), buf, buf + size);
+    return size;
+}
+
+static inline std::string hls_part_name(int64_t msn, size_t part) {
+    return "seg" + std::to_string(msn) + "." + std::to_string(part) + ".m4s";
+}
+
+static inline std::string hls_segment_name(int64_t msn) {
+    return "seg" + std::to_string(msn) + ".m4s";
+}
+
+// Whole-file write published with rename(), so the origin never serves a partial file.
+static bool hls_write_file(HlsWriter& h, const std::string& name, const void* data, size_t size) {
+    const std::string path = h.dir + "/" + name, tmp = path + ".tmp";
+    std::FILE* f = std::fopen(tmp.c_str(), "wb");
+    bool ok = f && std::fwrite(data, 1, size, f) == size;
+    if (f) ok = std::fclose(f) == 0 && ok;
+    ok = ok && std::rename(tmp.c_str(), path.c_str()) == 0;
+    if (!ok) ++h.write_errors;
+    return ok;
+}
+
+// "avc1.PPCCLL": profile_idc, constraint flags and level_idc of the first SPS in an Annex B packet
+static std::string hls_avc_codecs(const AVPacket* pkt) {
+    const uint8_t* p = pkt->data;
+    for (int i = 0; i + 6 < pkt->size; ++i) {
+        if (p[i] == 0 && p[i + 1] == 0 && p[i + 2] == 1 && (p[i + 3] & 0x1f) == 7) {
+            char s[16];
+            std::snprintf(s, sizeof(s), "avc1.%02X%02X%02X", p[i + 4], p[i + 5], p[i + 6]);
+            return s;
+        }
+    }
+    return std::string();
+}
+
+static void hls_write_master(HlsWriter& h) {
+    char line[512];
+    std::string m = "#EXTM3U\n#EXT-X-VERSION:9\n#EXT-X-INDEPENDENT-SEGMENTS\n"
+                    "#EXT-X-MEDIA:TYPE=CLOSED-CAPTIONS,GROUP-ID=\"cc\",NAME=\"CC1\",INSTREAM-ID=\"CC1\",DEFAULT=YES,AUTOSELECT=YES\n";
+    std::snprintf(line, sizeof(line), "#EXT-X-STREAM-INF:BANDWIDTH=%lld", (long long)(h.peak_bps * 1.1));
+    m += line;
+    if (!h.codecs.empty()) m += ",CODECS=\"" + h.codecs + (h.has_audio ? ",mp4a.40.2\"" : "\"");
+    std::snprintf(line, sizeof(line), ",RESOLUTION=%dx%d,FRAME-RATE=%.3f,CLOSED-CAPTIONS=\"cc\"\nindex.m3u8\n",
+                  h.width, h.height, av_q2d(h.rate));
+    m += line;
+    h.master_written = hls_write_file(h, "master.m3u8", m.data(), m.size());
+}
+
+// Parts are listed for the open segment and the two before it; older segments appear whole.
+static void hls_write_playlist(HlsWriter& h, bool ended) {
+    char line[256];
+    std::string m;
+    m.reserve(4096);
+    std::snprintf(line, sizeof(line),
+                  "#EXTM3U\n#EXT-X-VERSION:9\n#EXT-X-TARGETDURATION:%d\n#EXT-X-PART-INF:PART-TARGET=%.3f\n"
+                  "#EXT-X-SERVER-CONTROL:%sPART-HOLD-BACK=%.3f\n#EXT-X-MEDIA-SEQUENCE:%lld\n"
+                  "#EXT-X-MAP:URI=\"init.mp4\"\n",
+                  h.target_s, h.part_us / 1e6, h.blocking_reload ? "CAN-BLOCK-RELOAD=YES," : "",
+                  3.0 * h.part_us / 1e6, (long long)(h.segs.empty() ? 0 : h.segs.front().msn));
+    m += line;
+    const size_t parts_from = h.segs.size() > 3 ? h.segs.size() - 3 : 0;
+    for (size_t i = 0; i < h.segs.size(); ++i) {
+        const HlsSegment& s = h.segs[i];
+        if (i >= parts_from) {
+            for (size_t k = 0; k < s.parts.size(); ++k) {
+                std::snprintf(line, sizeof(line), "#EXT-X-PART:DURATION=%.5f,URI=\"%s\"%s\n", s.parts[k].dur,
+                              hls_part_name(s.msn, k).c_str(), s.parts[k].independent ? ",INDEPENDENT=YES" : "");
+                m += line;
+            }
+        }
+        if (s.complete) {
+            std::snprintf(line, sizeof(line), "#EXTINF:%.5f,\n%s\n", s.dur, hls_segment_name(s.msn).c_str());
+            m += line;
+        }
+    }
+    if (ended) {
+        m += "#EXT-X-ENDLIST\n";
+    } else if (!h.segs.empty()) {
+        const HlsSegment& open = h.segs.back();
+        m += "#EXT-X-PRELOAD-HINT:TYPE=PART,URI=\"" + hls_part_name(open.msn, open.parts.size()) + "\"\n";
+    }
+    hls_write_file(h, "index.m3u8", m.data(), m.size());
+}
+
+// Move ftyp/moov out of h.chunk into h.init; what stays is the part (moof + mdat).
+static void hls_split_init(HlsWriter& h) {
+    const size_t size = h.chunk.size();
+    size_t off = 0, media = 0;
+    while (off < size) {
+        const uint8_t* b = h.chunk.data() + off;
+        uint64_t box = size - off;
+        if (size - off >= 8) {
+            uint64_t sz = ((uint64_t)b[0] << 24) | ((uint64_t)b[1] << 16) | ((uint64_t)b[2] << 8) | b[3];
+            if (sz == 1 && size - off >= 16) {
+                sz = 0;
+                for (int k = 8; k < 16; ++k) sz = (sz << 8) | b[k];
+            }
+            if (sz >= 8 && sz <= size - off) box = sz;   // 0 ("to end") and malformed sizes take the rest
+        }
+        const bool init_box = box >= 8 && (std::memcmp(b + 4, "ftyp", 4) == 0 || std::memcmp(b + 4, "moov", 4) == 0);
+        if (init_box) {
+            if (!h.init_written) h.init.insert(h.init.end(), b, b + box);
+        } else {
+            if (media != off) std::memmove(h.chunk.data() + media, b, (size_t)box);
+            media += (size_t)box;
+        }
+        off += (size_t)box;
+    }
+    h.chunk.resize(media);
+}
+
+// Close the open part at ts_us (the next frame's DTS); with end_segment also the segment.
+static void hls_cut(HlsWriter& h, AVFormatContext* ofmt, int64_t ts_us, bool end_segment) {
+    const int64_t t0 = av_gettime_relative();
+    av_write_frame(ofmt, nullptr);               // frag_custom: one moof + mdat for what is queued
+    avio_flush(ofmt->pb);
+    hls_split_init(h);
+    if (!h.init_written && !h.init.empty()) {
+        h.init_written = hls_write_file(h, "init.mp4", h.init.data(), h.init.size());
+        if (h.init_written) std::vector<uint8_t>().swap(h.init);
+    }
+
+    HlsSegment& seg = h.segs.back();
+    if (!h.chunk.empty()) {
+        hls_write_file(h, hls_part_name(seg.msn, seg.parts.size()), h.chunk.data(), h.chunk.size());
+        if (!h.seg_file) h.seg_file = std::fopen((h.dir + "/" + hls_segment_name(seg.msn) + ".tmp").c_str(), "wb");
+        if (!h.seg_file || std::fwrite(h.chunk.data(), 1, h.chunk.size(), h.seg_file) != h.chunk.size()) ++h.write_errors;
+        HlsPart part;
+        part.dur = (ts_us - h.part_start_us) / 1e6;
+        part.independent = h.part_independent;
+        seg.parts.push_back(part);
+        h.bytes += h.chunk.size();
+        h.seg_bytes += h.chunk.size();
+        ++h.parts;
+        h.chunk.clear();
+    }
+    h.part_start_us = ts_us;
+
+    if (end_segment) {
+        seg.dur = (ts_us - h.seg_start_us) / 1e6;
+        seg.complete = true;
+        const std::string name = hls_segment_name(seg.msn), path = h.dir + "/" + name;
+        if (h.seg_file) {
+            if (std::fclose(h.seg_file) != 0 || std::rename((path + ".tmp").c_str(), path.c_str()) != 0) ++h.write_errors;
+            h.seg_file = nullptr;
+        }
+        if (seg.dur > 0.0) h.peak_bps = std::max(h.peak_bps, h.seg_bytes * 8.0 / seg.dur);
+        h.seg_bytes = 0;
+        ++h.segments;
+        if (!h.master_written) hls_write_master(h);
+
+        HlsSegment next;
+        next.msn = seg.msn + 1;
+        h.segs.push_back(next);
+        h.seg_start_us = ts_us;
+
+        // Slide the window. A segment's files outlive its playlist entry by one segment, so a
+        // client that fetched the previous playlist can still get them.
+        while (h.segs.size() > (size_t)h.list_size + 1) {
+            if (h.retired_msn >= 0) {
+                std::remove((h.dir + "/" + hls_segment_name(h.retired_msn)).c_str());
+                for (size_t k = 0; k < h.retired_parts; ++k)
+                    std::remove((h.dir + "/" + hls_part_name(h.retired_msn, k)).c_str());
+            }
+            h.retired_msn = h.segs.front().msn;
+            h.retired_parts = h.segs.front().parts.size();
+            h.segs.pop_front();
+        }
+    }
+    hls_write_playlist(h, false);
+
+    const int64_t dt = av_gettime_relative() - t0;
+    h.publish_us_sum += dt;
+    h.publish_us_max = std::max(h.publish_us_max, dt);
+}
+
+// One packet from the tee writer, already in the mp4 stream's time base; ts_us is its DTS.
+static bool hls_write_packet(HlsWriter& h, AVFormatContext* ofmt, AVPacket* pkt, int64_t ts_us, bool video) {
+    if (video) {
+        const bool key = (pkt->flags & AV_PKT_FLAG_KEY) != 0;
+        if (h.seg_start_us == AV_NOPTS_VALUE) {
+            if (!key) return true;                   // the first segment starts on an IDR
+            if (ofmt->streams[pkt->stream_index]->codecpar->codec_id == AV_CODEC_ID_H264) h.codecs = hls_avc_codecs(pkt);
+            h.seg_start_us = h.part_start_us = ts_us;
+            h.segs.push_back(HlsSegment{});
+            h.part_independent = true;
+        } else if (key && ts_us - h.seg_start_us >= h.seg_us - h.frame_us / 2) {
+            hls_cut(h, ofmt, ts_us, true);
+            h.part_independent = true;
+        } else if (ts_us + h.frame_us - h.part_start_us > h.part_us) {
+            hls_cut(h, ofmt, ts_us, false);
+            h.part_independent = key;
+        }
+        h.last_us = ts_us;
+    } else if (h.seg_start_us == AV_NOPTS_VALUE) {
+        return true;                                 // audio ahead of the first IDR
+    }
+    return av_write_frame(ofmt, pkt) >= 0;
+}
+
+// mp4 muxer on a memory sink; the caller adds streams and writes the header.
+static bool hls_alloc_output(HlsWriter& h, AVFormatContext** ofmt, AVDictionary** opts) {
+    if (mkdir(h.dir.c_str(), 0755) != 0 && errno != EEXIST) return false;
+    if (avformat_alloc_output_context2(ofmt, nullptr, "mp4", nullptr) < 0 || !*ofmt) return false;
+    const int buf_size = 1 << 16;
+    uint8_t* buf = (uint8_t*)av_malloc(buf_size);
+    h.pb = buf ? avio_alloc_context(buf, buf_size, 1, &h, nullptr, hls_sink_write, nullptr) : nullptr;
+    if (!h.pb) { av_free(buf); return false; }
+    (*ofmt)->pb = h.pb;
+    (*ofmt)->flags |= AVFMT_FLAG_CUSTOM_IO;
+    av_dict_set(opts, "movflags", "frag_custom+delay_moov+default_base_moof+cmaf", 0);
+    return true;
+}
+
+// Last part + segment, then the final playlist with EXT-X-ENDLIST.
+static void hls_finish(HlsWriter& h, AVFormatContext* ofmt) {
+    if (h.seg_start_us != AV_NOPTS_VALUE) {
+        hls_cut(h, ofmt, h.last_us + h.frame_us, true);
+        h.segs.pop_back();                           // the empty segment hls_cut opened
+        hls_write_playlist(h, true);
+    }
+    av_write_trailer(ofmt);                          // mfra only; not published
+    h.chunk.clear();
+}
+
+static void hls_close(HlsWriter& h) {
+    if (h.seg_file) std::fclose(h.seg_file);
+    h.seg_file = nullptr;
+    if (h.pb) av_freep(&h.pb->buffer);
+    avio_context_free(&h.pb);
+    if (h.parts)
+        std::cerr << "[hls] " << h.dir << ": segments=" << h.segments << " parts=" << h.parts << " bytes=" << h.bytes
+                  << " publish avg=" << (double)h.publish_us_sum / h.parts / 1000.0 << "ms max=" << h.publish_us_max / 1000.0
+                  << "ms write_errors=" << h.write_errors << "\n";
+}
+
+// ======================================================================================
+// Tee outputs (one encode -> N muxers, each drained by its own writer thread)
+// ======================================================================================
+//
+// "--tee=[f=segment:segment_time=60:segment_wrap=48]rec_%03d.ts" adds a destination next to
+// the main output: same encoded video and audio, its own container and protocol. Bracket
+// options are f=FORMAT (otherwise guessed from the URL, mpegts when that fails) plus muxer
+// options passed to avformat_write_header. Every packet the main output writes is also
+// av_packet_ref'd into each tee's queue, so the payload buffer is shared, not copied. Each tee's
+// writer thread muxes and does the I/O, so a stalled disk or a blocked socket only backs up its
+// own queue. A full queue never blocks the frame loop. Instead that output drops packets and
+// resumes on the next video keyframe, so its stream restarts cleanly at a decodable point.
+
+struct TeePacket {
+    AVPacket* pkt = nullptr;     // ref to the main output's packet (shell owned by the slot)
+    bool video = false;
+    bool eof = false;
+};
+
+struct TeeOutput {
+    std::string spec, url, format;
+    AVDictionary* opts = nullptr;        // muxer options from the bracket prefix
+    std::unique_ptr<HlsWriter> hls;      // --hls: the muxer writes fMP4 parts + playlists instead
+    AVFormatContext* ofmt = nullptr;
+    AVStream* vst = nullptr;
+    AVStream* ast = nullptr;
+    AVRational vtb{1,1}, atb{1,1};       // main output time bases the packets arrive in
+
+    std::vector<TeePacket> ring;         // queue_len slots
+    size_t head = 0, count = 0, max_depth = 0;
+    std::vector<AVPacket*> spare;        // unreferenced packet shells, guarded by mu
+    std::mutex mu;
+    std::condition_variable cv;
+    std::thread writer;
+
+    bool dropping = false;               // frame loop only
+    uint64_t packets = 0, bytes = 0, dropped = 0, drop_runs = 0, errors = 0;
+};
+
+// "[k=v:k=v]url" -> url, format and muxer options.
+static bool tee_parse_spec(TeeOutput& t) {
+    t.url = t.spec;
+    if (t.spec.empty() || t.spec[0] != '[') return !t.url.empty();
+    size_t close = t.spec.find(']');
+    if (close == std::string::npos) return false;
+    t.url = t.spec.substr(close + 1);
+    const std::string body = t.spec.substr(1, close - 1);
+    for (size_t p = 0; p < body.size(); ) {
+        size_t colon = body.find(':', p);
+        std::string kv = body.substr(p, colon == std::string::npos ? std::string::npos : colon - p);
+        p = colon == std::string::npos ? body.size() : colon + 1;
+        size_t eq = kv.find('=');
+        if (eq == std::string::npos || eq == 0) return false;
+        if (kv.compare(0, eq, "f") == 0) t.format = kv.substr(eq + 1);
+        else av_dict_set(&t.opts, kv.substr(0, eq).c_str(), kv.substr(eq + 1).c_str(), 0);
+    }
+    return !t.url.empty();
+}
+
+// True when the spec's container stores the codec headers once, out of band (mp4, mkv, flv...),
+// so the SPS/PPS of the first IDR must stay valid for the whole file.
+static bool tee_spec_global_header(const std::string& spec) {
+    TeeOutput t;
+    t.spec = spec;
+    const bool ok = tee_parse_spec(t);
+    const AVOutputFormat* fmt = ok ? av_guess_format(t.format.empty() ? nullptr : t.format.c_str(), t.url.c_str(), nullptr)
+                                   : nullptr;
+    av_dict_free(&t.opts);
+    return fmt && (fmt->flags & AVFMT_GLOBALHEADER);
+}
+
+static bool tee_open(TeeOutput& t, const AVStream* vout, const AVStream* aout, bool low_latency, size_t queue_len) {
+    if (t.hls) {
+        if (!hls_alloc_output(*t.hls, &t.ofmt, &t.opts)) return false;
+    } else {
+        const char* fmt = t.format.empty() ? nullptr : t.format.c_str();
+        if (!fmt && !av_guess_format(nullptr, t.url.c_str(), nullptr)) fmt = "mpegts";   // udp://, srt://, ...
+        if (avformat_alloc_output_context2(&t.ofmt, nullptr, fmt, t.url.c_str()) < 0 || !t.ofmt) return false;
+    }
+    t.vst = avformat_new_stream(t.ofmt, nullptr);
+    if (!t.vst || avcodec_parameters_copy(t.vst->codecpar, vout->codecpar) < 0) return false;
+    t.vst->codecpar->codec_tag = 0;      // let this muxer pick its own tag
+    t.vst->time_base = t.vtb = vout->time_base;
+    if (aout) {
+        t.ast = avformat_new_stream(t.ofmt, nullptr);
+        if (!t.ast || avcodec_parameters_copy(t.ast->codecpar, aout->codecpar) < 0) return false;
+        t.ast->codecpar->codec_tag = 0;
+        t.ast->time_base = t.atb = aout->time_base;
+    }
+    if (low_latency) t.ofmt->flags |= AVFMT_FLAG_FLUSH_PACKETS;
+    if (!t.ofmt->pb && !(t.ofmt->oformat->flags & AVFMT_NOFILE) && avio_open(&t.ofmt->pb, t.url.c_str(), AVIO_FLAG_WRITE) < 0) return false;
+    if (avformat_write_header(t.ofmt, &t.opts) < 0) return false;
+    for (const AVDictionaryEntry* e = nullptr; (e = av_dict_get(t.opts, "", e, AV_DICT_IGNORE_SUFFIX)); )
+        std::cerr << "[tee] " << t.url << ": unused option " << e->key << "=" << e->value << "\n";
+
+    // Every slot plus the one the writer holds can own a shell
+    t.ring.assign(queue_len, TeePacket{});
+    t.spare.reserve(queue_len + 1);
+    return true;
+}
+
+static void tee_writer(TeeOutput* t) {
+    for (;;) {
+        TeePacket job;
+        {
+            std::unique_lock<std::mutex> lk(t->mu);
+            t->cv.wait(lk, [t] { return t->count > 0; });
+            job = t->ring[t->head];
+            t->ring[t->head] = TeePacket{};
+            t->head = (t->head + 1) % t->ring.size();
+            --t->count;
+        }
+        t->cv.notify_all();
+        if (job.eof) break;
+        AVStream* st = job.video ? t->vst : t->ast;
+        const AVRational src_tb = job.video ? t->vtb : t->atb;
+        const int64_t ts_us = av_rescale_q(job.pkt->dts != AV_NOPTS_VALUE ? job.pkt->dts : job.pkt->pts, src_tb, AVRational{1, AV_TIME_BASE});
+        av_packet_rescale_ts(job.pkt, src_tb, st->time_base);
+        job.pkt->stream_index = st->index;
+        const int size = job.pkt->size;
+        const bool ok = t->hls ? hls_write_packet(*t->hls, t->ofmt, job.pkt, ts_us, job.video)
+                               : av_interleaved_write_frame(t->ofmt, job.pkt) >= 0;
+        if (!ok) ++t->errors;
+        else { ++t->packets; t->bytes += size; }
+        av_packet_unref(job.pkt);   // already blank after a write; keeps the shell clean on errors
+        std::lock_guard<std::mutex> lk(t->mu);
+        t->spare.push_back(job.pkt);
+    }
+    if (t->hls) hls_finish(*t->hls, t->ofmt);
+    else if (av_write_trailer(t->ofmt) < 0) ++t->errors;
+}
+
+// Called with the packet about to go to the main output (already in its stream time base).
+static void tee_submit(std::vector<std::unique_ptr<TeeOutput>>& tees, const AVPacket* pkt, bool video) {
+    for (auto& tp : tees) {
+        TeeOutput& t = *tp;
+        if (!video && !t.ast) continue;
+        AVPacket* shell = nullptr;
+        {
+            std::lock_guard<std::mutex> lk(t.mu);
+            const bool full = t.count >= t.ring.size();
+            if (t.dropping && !full && video && (pkt->flags & AV_PKT_FLAG_KEY)) {
+                t.dropping = false;
+                std::cerr << "[tee] " << t.url << ": resumed on keyframe\n";
+            }
+            if (full && !t.dropping) {
+                t.dropping = true;
+                ++t.drop_runs;
+                std::cerr << "[tee] " << t.url << ": queue full, dropping until the next keyframe\n";
+            }
+            if (t.dropping) { ++t.dropped; continue; }
+            if (!t.spare.empty()) { shell = t.spare.back(); t.spare.pop_back(); }
+        }
+        if (!shell) shell = av_packet_alloc();
+        if (!shell || av_packet_ref(shell, pkt) < 0) { av_packet_free(&shell); ++t.errors; continue; }
+        {
+            std::lock_guard<std::mutex> lk(t.mu);
+            TeePacket& slot = t.ring[(t.head + t.count) % t.ring.size()];
+            slot.pkt = shell;
+            slot.video = video;
+            ++t.count;
+            t.max_depth = std::max(t.max_depth, t.count);
+        }
+        t.cv.notify_all();
+    }
+}
+
+static void tee_close(std::vector<std::unique_ptr<TeeOutput>>& tees) {
+    for (auto& tp : tees) {
+        TeeOutput& t = *tp;
+        if (t.writer.joinable()) {
+            {
+                // The EOF marker waits for a free slot; the writer is still draining
+                std::unique_lock<std::mutex> lk(t.mu);
+                t.cv.wait(lk, [&t] { return t.count < t.ring.size(); });
+                t.ring[(t.head + t.count) % t.ring.size()].eof = true;
+                ++t.count;
+            }
+            t.cv.notify_all();
+            t.writer.join();
+            std::cerr << "[tee] " << t.url << " (" << (t.ofmt ? t.ofmt->oformat->name : "?") << "): packets=" << t.packets
+                      << " bytes=" << t.bytes << " dropped=" << t.dropped << " in " << t.drop_runs << " run(s)"
+                      << " max_queue=" << t.max_depth << "/" << t.ring.size() << " errors=" << t.errors << "\n";
+        }
+        for (TeePacket& slot : t.ring) av_packet_free(&slot.pkt);
+        for (AVPacket*& p : t.spare) av_packet_free(&p);
+        av_dict_free(&t.opts);
+        if (t.hls) hls_close(*t.hls);                // owns the custom pb
+        else if (t.ofmt && !(t.ofmt->oformat->flags & AVFMT_NOFILE)) avio_closep(&t.ofmt->pb);
+        if (t.ofmt) avformat_free_context(t.ofmt);
+    }
+    tees.clear();
+}
+
+// ======================================================================================
+// Caption round-trip check (embedded decoder)
+// ======================================================================================
+//
+// With B-frames the encoder emits pictures in coding order, and each picture's A/53 SEI/user data
+// must carry the cc_data attached to that picture in display order. --verify_cc=1 decodes every
+// encoded video packet again (before it reaches the muxer). It then compares the A53_CC side data
+// of each output picture with what the scheduler attached to the same PTS. Any difference means
+// caption bytes were dropped, duplicated or reordered.
+
+struct CcVerifier {
+    AVCodecContext* dec = nullptr;
+    AVFrame* frm = nullptr;
+    // Pictures sent but not yet decoded, display order. A fixed ring: the encoder's reorder +
+    // lookahead depth is far below its size; overflow drops the oldest as missing.
+    std::vector<std::pair<int64_t, CcData>> expected = std::vector<std::pair<int64_t, CcData>>(256);
+    size_t head = 0, count = 0;
+    uint64_t frames = 0, cc_bytes = 0, mismatches = 0, missing = 0, unexpected = 0;
+};
+
+static bool cc_verify_open(CcVerifier& v, const AVCodecContext* enc) {
+    const AVCodec* codec = avcodec_find_decoder(enc->codec_id);
+    if (!codec) return false;
+    v.dec = avcodec_alloc_context3(codec);
+    v.frm = av_frame_alloc();
+    if (v.dec && v.frm) {
+        v.dec->pkt_timebase = enc->time_base;
+        v.dec->thread_count = 1;
+        if (avcodec_open2(v.dec, codec, nullptr) == 0) return true;
+    }
+    av_frame_free(&v.frm);
+    avcodec_free_context(&v.dec);
+    return false;
+}
+
+static void cc_verify_pop(CcVerifier& v) {
+    v.head = (v.head + 1) % v.expected.size();
+    --v.count;
+}
+
+static void cc_verify_expect(CcVerifier& v, int64_t pts, const CcData& cc) {
+    if (!v.dec || pts == AV_NOPTS_VALUE) return;
+    if (v.count == v.expected.size()) { ++v.missing; cc_verify_pop(v); }
+    v.expected[(v.head + v.count) % v.expected.size()] = {pts, cc};
+    ++v.count;
+}
+
+static void cc_verify_receive(CcVerifier& v) {
+    while (avcodec_receive_frame(v.dec, v.frm) == 0) {
+        const int64_t pts = v.frm->pts;
+        const AVFrameSideData* sd = av_frame_get_side_data(v.frm, AV_FRAME_DATA_A53_CC);
+        const uint8_t* got = sd ? sd->data : nullptr;
+        const size_t got_n = sd ? sd->size : 0;
+        ++v.frames;
+
+        // Pictures the decoder never returned (should not happen) are counted and skipped
+        while (v.count && pts != AV_NOPTS_VALUE && v.expected[v.head].first < pts) {
+            ++v.missing;
+            cc_verify_pop(v);
+        }
+        if (!v.count || v.expected[v.head].first != pts) {
+            if (got_n) {
+                ++v.unexpected;
+                std::cerr << "[verify] pts=" << pts << ": " << got_n << " cc bytes on an unknown picture\n";
+            }
+            av_frame_unref(v.frm);
+            continue;
+        }
+        const CcData& want = v.expected[v.head].second;
+        if (want.size != got_n || (got_n && std::memcmp(want.bytes, got, got_n) != 0)) {
+            ++v.mismatches;
+            std::cerr << "[verify] pts=" << pts << ": cc_data mismatch (sent " << want.size
+                      << " bytes, decoded " << got_n << ")\n";
+        }
+        v.cc_bytes += got_n;
+        cc_verify_pop(v);
+        av_frame_unref(v.frm);
+    }
+}
+
+// pkt is in the encoder time base and is only read.
+static void cc_verify_packet(CcVerifier& v, const AVPacket* pkt) {
+    if (!v.dec) return;
+    if (avcodec_send_packet(v.dec, pkt) < 0) return;
+    cc_verify_receive(v);
+}
+
+static void cc_verify_close(CcVerifier& v) {
+    if (!v.dec) return;
+    avcodec_send_packet(v.dec, nullptr);
+    cc_verify_receive(v);
+    v.missing += v.count;
+    std::cerr << "[verify] pictures=" << v.frames << " cc_bytes=" << v.cc_bytes << " mismatches=" << v.mismatches
+              << " missing=" << v.missing << " unexpected=" << v.unexpected
+              << (v.mismatches || v.missing || v.unexpected ? " -> FAILED" : " -> caption order preserved") << "\n";
+    av_frame_free(&v.frm);
+    avcodec_free_context(&v.dec);
+}
+
+// ======================================================================================
+// UDP output (CBR muxrate + paced 7x188-byte datagrams, sendmmsg / GSO batching)
+// ======================================================================================
+//
+// With --muxrate_kbps the mpegts muxer runs in CBR mode: it stuffs null packets up to the rate
+// and derives every PCR from the byte position, so PCR accuracy follows from the constant rate.
+// What the muxer cannot do is spread its output in time: a picture's packets leave in one burst.
+// For udp:// outputs the injector replaces avio's udp protocol with a custom AVIOContext. Its
+// write callback packs the TS into 1316-byte datagrams (7 packets) in a bounded ring. A sender
+// thread releases datagram k at t0 + k * 1316 * 8 / muxrate on CLOCK_MONOTONIC. The deadlines are
+// absolute (clock_nanosleep), so sleep overshoot does not add up. Each byte then leaves when its
+// PCR says it should, and the wire rate is the mux rate. A full ring blocks the muxer, which also
+// paces file inputs. A slow servo (at most ±30 ppm) keeps the ring near its starting fill, so a
+// live source whose clock differs from ours neither drains nor floods it over a long run.
+//
+// --udp_batch=N hands up to N datagrams to the kernel per syscall. UDP GSO (UDP_SEGMENT) is used
+// when the socket accepts it: one send of N x 1316 bytes that the kernel or the NIC splits. Without
+// GSO, sendmmsg is used instead. A paced batch leaves at the midpoint of its datagrams' deadlines,
+// so no datagram is more than (N-1)/2 periods off its ideal time. SO_MAX_PACING_RATE is set too,
+// so an fq qdisc spreads each batch back out on the wire. Without --muxrate_kbps the same writer
+// runs unpaced: the sender waits for a full batch, or for the end of the muxer's AVIO buffer
+// flush, and sends what is queued then.
+
+struct UdpPacer {
+    static const size_t kDatagram = 7 * 188;
+    static const int kMaxBatch = 32;     // 32 x 1316 stays under the 64 KiB GSO limit
+    int fd = -1;
+    std::string label;
+    int64_t rate_bps = 0;                // 0 = unpaced
+    int batch = 1;
+    bool gso = false;
+    AVIOContext* pb = nullptr;
+
+    std::vector<uint8_t> slots;          // cap datagrams
+    std::vector<uint16_t> lens;
+    size_t cap = 0, head = 0, count = 0;
+    size_t prebuffer = 0;                // datagrams queued before the first release
+    size_t fill_idx = 0, cur = 0;        // slot being filled and its byte count (mux thread)
+    bool handed_off = false;             // unpaced: everything the muxer flushed so far is queued
+    bool eof = false;
+    std::mutex mu;
+    std::condition_variable cv;
+    std::thread sender;
+
+    double ppm = 0.0;                    // servo correction last applied
+    uint64_t sent = 0, bytes = 0, send_errors = 0, underruns = 0, resyncs = 0, writer_waits = 0;
+    uint64_t syscalls = 0;
+    int64_t late_ns_sum = 0, late_ns_max = 0;
+    int64_t cpu_ns = 0;                  // sender thread CPU time
+
+    ~UdpPacer() {                        // early exits; udp_pacer_close() is the normal path
+        if (!sender.joinable()) return;
+        { std::lock_guard<std::mutex> lk(mu); eof = true; }
+        cv.notify_all();
+        sender.join();
+    }
+};
+
+static inline int64_t mono_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// "udp://HOST:PORT[?ttl=N&localaddr=IP]" with IPv4 literals, like --cc-udp.
+static bool udp_pacer_connect(UdpPacer& p, const std::string& url) {
+    std::string rest = url.substr(6), query;
+    size_t q = rest.find('?');
+    if (q != std::string::npos) { query = rest.substr(q + 1); rest.erase(q); }
+    size_t colon = rest.rfind(':');
+    if (colon == std::string::npos) return false;
+    int port = std::atoi(rest.c_str() + colon + 1);
+    sockaddr_in dst{}; dst.sin_family = AF_INET;
+    dst.sin_port = htons((uint16_t)port);
+    if (port <= 0 || port > 65535 || inet_aton(rest.substr(0, colon).c_str(), &dst.sin_addr) == 0) return false;
+
+    p.fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (p.fd < 0) return false;
+    int ttl = 16;
+    for (size_t a = 0; a < query.size(); ) {
+        size_t amp = query.find('&', a);
+        std::string kv = query.substr(a, amp == std::string::npos ? std::string::npos : amp - a);
+        a = amp == std::string::npos ? query.size() : amp + 1;
+        if (kv.compare(0, 4, "ttl=") == 0) {
+            ttl = std::atoi(kv.c_str() + 4);
+        } else if (kv.compare(0, 10, "localaddr=") == 0) {
+            in_addr ifa{};
+            if (inet_aton(kv.c_str() + 10, &ifa)) setsockopt(p.fd, IPPROTO_IP, IP_MULTICAST_IF, &ifa, sizeof(ifa));
+        }
+    }
+    if (IN_MULTICAST(ntohl(dst.sin_addr.s_addr))) setsockopt(p.fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+    else                                          setsockopt(p.fd, IPPROTO_IP, IP_TTL, &ttl, sizeof(ttl));
+    if (connect(p.fd, (sockaddr*)&dst, sizeof(dst)) != 0) { close(p.fd); p.fd = -1; return false; }
+    p.label = url;
+    return true;
+}
+
+// Unpaced, the sender is only woken for a full batch; the rest goes when the write call ends.
+static void udp_pacer_push(UdpPacer& p) {
+    bool wake;
+    {
+        std::lock_guard<std::mutex> lk(p.mu);
+        p.lens[p.fill_idx] = (uint16_t)p.cur;
+        ++p.count;
+        wake = p.rate_bps > 0 || p.count >= (size_t)p.batch;
+    }
+    p.cur = 0;
+    if (wake) p.cv.notify_all();
+}
+
+// AVIOContext write callback (mux thread): TS bytes -> whole datagrams in the ring.
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+static int udp_pacer_write(void* opaque, const uint8_t* buf, int size) {
+#else
+static int udp_pacer_write(void* opaque, uint8_t* buf, int size) {
+#endif
+    UdpPacer& p = *(UdpPacer*)opaque;
+    for (int left = size; left > 0; ) {
+        if (p.cur == 0) {
+            // Claim the next free slot. Only the sender changes count from here on, and only
+            // downwards, so the slot stays ours until it is pushed.
+            std::unique_lock<std::mutex> lk(p.mu);
+            if (p.count >= p.cap) {
+                ++p.writer_waits;
+                p.cv.wait(lk, [&p] { return p.count < p.cap; });
+            }
+            p.fill_idx = (p.head + p.count) % p.cap;
+        }
+        const size_t n = std::min((size_t)left, UdpPacer::kDatagram - p.cur);
+        std::memcpy(p.slots.data() + p.fill_idx * UdpPacer::kDatagram + p.cur, buf, n);
+        p.cur += n;
+        buf += n;
+        left -= (int)n;
+        if (p.cur == UdpPacer::kDatagram) udp_pacer_push(p);
+    }
+    if (p.rate_bps <= 0) {
+        // An AVIO buffer flush: send what is queued even if it is less than a batch
+        { std::lock_guard<std::mutex> lk(p.mu); p.handed_off = true; }
+        p.cv.notify_all();
+    }
+    return size;
+}
+
+// k datagrams from slot idx on (contiguous, no wrap) in as few syscalls as the socket allows.
+static bool udp_pacer_send(UdpPacer& p, size_t idx, size_t k) {
+    const uint8_t* base = p.slots.data() + idx * UdpPacer::kDatagram;
+    if (k == 1) { ++p.syscalls; return send(p.fd, base, p.lens[idx], 0) >= 0; }
+#ifdef UDP_SEGMENT
+    if (p.gso) {
+        ++p.syscalls;
+        if (send(p.fd, base, (k - 1) * UdpPacer::kDatagram + p.lens[idx + k - 1], 0) >= 0) return true;
+        if (errno != EIO && errno != EINVAL) return false;
+        // The route's device cannot segment (no checksum offload, some tunnels): stay on sendmmsg
+        std::cerr << "[udp] " << p.label << ": GSO send failed (" << std::strerror(errno) << "); using sendmmsg\n";
+        int off = 0;
+        setsockopt(p.fd, IPPROTO_UDP, UDP_SEGMENT, &off, sizeof(off));
+        p.gso = false;
+    }
+#endif
+    mmsghdr msgs[UdpPacer::kMaxBatch];
+    iovec iov[UdpPacer::kMaxBatch];
+    std::memset(msgs, 0, sizeof(mmsghdr) * k);
+    for (size_t i = 0; i < k; ++i) {
+        iov[i].iov_base = (void*)(base + i * UdpPacer::kDatagram);
+        iov[i].iov_len = p.lens[idx + i];
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    for (size_t done = 0; done < k; ) {
+        ++p.syscalls;
+        int n = sendmmsg(p.fd, msgs + done, (unsigned)(k - done), 0);
+        if (n <= 0) return false;
+        done += (size_t)n;
+    }
+    return true;
+}
+
+static void udp_pacer_thread(UdpPacer* p) {
+    const bool paced = p->rate_bps > 0;
+    const double period_ns = paced ? UdpPacer::kDatagram * 8 * 1e9 / (double)p->rate_bps : 0.0;
+    const double target = (double)std::max<size_t>(p->prebuffer, 1);
+    double fill_avg = target, offset_ns = 0.0;
+    int64_t anchor = 0;
+    bool anchored = false;
+    for (;;) {
+        size_t idx, k;
+        {
+            std::unique_lock<std::mutex> lk(p->mu);
+            if (!paced) {
+                // Unpaced: a full batch, or whatever the muxer's last buffer flush left
+                p->cv.wait(lk, [p] { return p->count >= (size_t)p->batch || p->eof || (p->handed_off && p->count); });
+            } else {
+                if (anchored && p->count == 0 && !p->eof) {
+                    ++p->underruns;      // the muxer fell behind the rate: rebuild the cushion
+                    anchored = false;
+                }
+                if (!anchored) p->cv.wait(lk, [p] { return p->count >= p->prebuffer || p->eof; });
+            }
+            if (p->count == 0) break;    // EOF and drained
+            idx = p->head;
+            k = std::min(std::min((size_t)p->batch, p->count), p->cap - idx);
+            if (k == p->count) p->handed_off = false;
+            fill_avg += 0.001 * ((double)p->count - fill_avg);
+        }
+
+        if (paced) {
+            const int64_t now = mono_ns();
+            if (!anchored) {
+                anchor = now; offset_ns = 0.0; anchored = true;
+            } else if (now - (anchor + (int64_t)offset_ns) > 50000000) {
+                ++p->resyncs;            // stalled 50 ms: restart the schedule instead of bursting
+                anchor = now; offset_ns = 0.0;
+            }
+            // A batch leaves at the midpoint of its datagrams' deadlines
+            const int64_t due = anchor + (int64_t)(offset_ns + period_ns * (double)(k - 1) / 2.0);
+            if (due > now) {
+                timespec ts{ (time_t)(due / 1000000000), (long)(due % 1000000000) };
+                while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) {}
+            }
+            const int64_t late = std::max<int64_t>(0, mono_ns() - due);
+            p->late_ns_sum += late * (int64_t)k;
+            p->late_ns_max = std::max(p->late_ns_max, late);
+        }
+
+        size_t len = 0;
+        for (size_t i = 0; i < k; ++i) len += p->lens[idx + i];
+        if (!udp_pacer_send(*p, idx, k)) ++p->send_errors;
+        else { p->sent += k; p->bytes += len; }
+        {
+            std::lock_guard<std::mutex> lk(p->mu);
+            p->head = (p->head + k) % p->cap;
+            p->count -= k;
+        }
+        p->cv.notify_all();
+
+        if (paced) {
+            // Fuller than at start: our clock is slow relative to the source, release a bit faster
+            p->ppm = std::min(30.0, std::max(-30.0, 30.0 * (fill_avg - target) / target));
+            offset_ns += period_ns * (double)k * (1.0 - p->ppm * 1e-6);
+        }
+    }
+    timespec cpu;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu) == 0) p->cpu_ns = (int64_t)cpu.tv_sec * 1000000000 + cpu.tv_nsec;
+}
+
+// Paced: one second of ring, 50 ms of it filled before the first datagram leaves.
+// Unpaced (rate_bps 0): 1024 datagrams, each sent as soon as it is complete.
+static bool udp_pacer_open(UdpPacer& p, const std::string& url, int64_t rate_bps, int batch) {
+    if (!udp_pacer_connect(p, url)) return false;
+    p.rate_bps = rate_bps;
+    p.batch = std::min(std::max(batch, 1), UdpPacer::kMaxBatch);
+    const size_t per_sec = (size_t)(rate_bps / 8 / (int64_t)UdpPacer::kDatagram);
+    p.cap = rate_bps > 0 ? std::max<size_t>(64, per_sec) : 1024;
+    p.prebuffer = rate_bps > 0 ? std::max<size_t>(4, per_sec / 20) : 1;
+#ifdef UDP_SEGMENT
+    int seg = (int)UdpPacer::kDatagram;
+    p.gso = p.batch > 1 && setsockopt(p.fd, IPPROTO_UDP, UDP_SEGMENT, &seg, sizeof(seg)) == 0;
+#endif
+#ifdef SO_MAX_PACING_RATE
+    if (rate_bps > 0 && p.batch > 1) {
+        // fq spreads a batch at just above the mux rate instead of at line rate
+        unsigned int pace = (unsigned int)std::min<int64_t>(rate_bps / 8 * 11 / 10, UINT32_MAX - 1);
+        setsockopt(p.fd, SOL_SOCKET, SO_MAX_PACING_RATE, &pace, sizeof(pace));
+    }
+#endif
+    p.slots.assign(p.cap * UdpPacer::kDatagram, 0);
+    p.lens.assign(p.cap, 0);
+    const int buf_size = (int)UdpPacer::kDatagram * std::max(8, p.batch);   // a flush carries a whole batch
+    uint8_t* buf = (uint8_t*)av_malloc(buf_size);
+    p.pb = buf ? avio_alloc_context(buf, buf_size, 1, &p, nullptr, udp_pacer_write, nullptr) : nullptr;
+    if (!p.pb) { av_free(buf); close(p.fd); p.fd = -1; return false; }
+    p.sender = std::thread(udp_pacer_thread, &p);
+    return true;
+}
+
+// After av_write_trailer: send the tail (a short last datagram if the TS ends mid-group).
+static void udp_pacer_close(UdpPacer& p) {
+    if (p.pb) avio_flush(p.pb);
+    if (p.sender.joinable()) {
+        if (p.cur) udp_pacer_push(p);
+        {
+            std::lock_guard<std::mutex> lk(p.mu);
+            p.eof = true;
+        }
+        p.cv.notify_all();
+        p.sender.join();
+        std::cerr << "[udp] " << p.label << ": datagrams=" << p.sent;
+        if (p.rate_bps > 0)
+            std::cerr << " at " << p.rate_bps / 1000 << " kbit/s, release late avg="
+                      << (p.sent ? p.late_ns_sum / (int64_t)p.sent / 1000 : 0) << "us max=" << p.late_ns_max / 1000
+                      << "us, underruns=" << p.underruns << " resyncs=" << p.resyncs << " servo=" << p.ppm << "ppm";
+        std::cerr << ", mux_waits=" << p.writer_waits << " send_errors=" << p.send_errors << "\n";
+        const double mbit = p.bytes * 8 / 1e6;
+        std::cerr << "[udp] syscalls=" << p.syscalls << " (" << (p.syscalls ? (double)p.sent / p.syscalls : 0.0)
+                  << " datagrams each, " << (p.batch == 1 ? "send" : p.gso ? "GSO" : "sendmmsg") << "), sender cpu="
+                  << (mbit > 0 ? p.cpu_ns / 1000.0 / mbit : 0.0) << "us/Mbit\n";
+    }
+    if (p.pb) av_freep(&p.pb->buffer);
+    avio_context_free(&p.pb);
+    if (p.fd >= 0) close(p.fd);
+    p.fd = -1;
+}
+
+// ======================================================================================
+// End-to-end latency (input packet read -> output packet written)
+// ======================================================================================
+//
+// Each video packet's read time is remembered under its PTS (encoder time base); when the encoder
+// emits the packet with that PTS and the muxer has written it, the difference goes into a
+// 0.1 ms histogram (2 s range, larger values clamp to the last bin but still set max).
+
+struct LatencyStats {
+    bool enabled = false;
+    std::vector<std::pair<int64_t,int64_t>> inflight = std::vector<std::pair<int64_t,int64_t>>(512, {AV_NOPTS_VALUE, 0});
+    size_t next = 0;
+    std::vector<uint32_t> hist = std::vector<uint32_t>(20000, 0);
+    uint64_t n = 0, unmatched = 0;
+    int64_t max_us = 0;
+    double frame_ms = 33.3;
+};
+
+static void latency_note_input(LatencyStats& ls, int64_t pts, int64_t now_us) {
+    if (pts == AV_NOPTS_VALUE) return;
+    ls.inflight[ls.next] = {pts, now_us};
+    ls.next = (ls.next + 1) % ls.inflight.size();
+}
+
+static void latency_note_output(LatencyStats& ls, int64_t pts, int64_t now_us) {
+    if (pts == AV_NOPTS_VALUE) return;
+    for (auto& e : ls.inflight) {
+        if (e.first != pts) continue;
+        int64_t us = now_us - e.second;
+        e.first = AV_NOPTS_VALUE;
+        ++ls.hist[(size_t)std::min<int64_t>(std::max<int64_t>(us / 100, 0), (int64_t)ls.hist.size() - 1)];
+        ls.max_us = std::max(ls.max_us, us);
+        ++ls.n;
+        return;
+    }
+    ++ls.unmatched;
+}
+
+static double latency_percentile_ms(const LatencyStats& ls, double q) {
+    if (!ls.n) return 0.0;
+    uint64_t want = (uint64_t)std::ceil(q * ls.n), acc = 0;
+    for (size_t b = 0; b < ls.hist.size(); ++b) {
+        acc += ls.hist[b];
+        if (acc >= want) return (b + 1) * 0.1;
+    }
+    return ls.max_us / 1000.0;
+}
+
+static void latency_report(const LatencyStats& ls, const char* when) {
+    if (!ls.enabled || !ls.n) return;
+    double p99 = latency_percentile_ms(ls, 0.99);
+    std::cerr << "[lat] " << when << " n=" << ls.n
+              << " p50=" << latency_percentile_ms(ls, 0.50) << "ms p90=" << latency_percentile_ms(ls, 0.90)
+              << "ms p99=" << p99 << "ms p99.9=" << latency_percentile_ms(ls, 0.999)
+              << "ms max=" << ls.max_us / 1000.0 << "ms (p99 " << p99 / ls.frame_ms << " frames, "
+              << (p99 <= 2.0 * ls.frame_ms ? "within" : "OVER") << " 2-frame budget)"
+              << (ls.unmatched ? " unmatched=" : "");
+    if (ls.unmatched) std::cerr << ls.unmatched;
+    std::cerr << "\n";
+}
+
+// ======================================================================================
+// Asynchronous output writer (custom AVIOContext -> lock-free byte ring -> writer thread)
+// ======================================================================================
+//
+// av_interleaved_write_frame runs in the frame loop, so a slow disk or a blocked destination
+// used to stall decode and encode with it. --out_ring_kb puts a custom AVIOContext between the
+// muxer and the real output. Its write callback only copies into a single-producer /
+// single-consumer byte ring (the mux thread produces, one writer thread consumes, same
+// head/tail discipline as SpscRing). The writer thread does the avio_write on the real
+// AVIOContext. The mutex and condition variables are only for sleeping. Waits are bounded at
+// 2 ms, so a notify that races a waiter costs at most that.
+//
+// The ring is a power of two, which 188 does not divide, so the writer only ever drains whole
+// units and stitches a unit that straddles the wrap in a staging buffer. On packet protocols
+// (udp://, rtp://: inner->max_packet_size set) the unit is a 7-packet datagram and the writer
+// never flushes, so avio keeps cutting full datagrams. Stream outputs (files, tcp://) drain
+// whole TS packets and are flushed after every drain, so a write that blocks does so here.
+//
+// When the ring is full, --out_ring_overflow=block makes the muxer wait (lossless; the stall is
+// then the destination's). drop discards the whole chunk the muxer handed over. The AVIO buffer
+// is a multiple of 188 bytes and the mpegts muxer writes whole packets, so a chunk always
+// starts and ends on a TS packet boundary and a drop leaves a clean gap (continuity errors) for
+// the receiver rather than torn packets.
+
+struct AsyncOutput {
+    static const int kChunk = 188 * 64;  // AVIO buffer: the largest piece the callback gets
+    AVIOContext* inner = nullptr;        // the real destination
+    AVIOContext* pb = nullptr;           // what the muxer writes to
+    bool drop = false;
+    size_t unit = 188;                   // drains are whole units (7 x 188 on packet protocols)
+    bool flush = true;                   // avio_flush after each drain (not on packet protocols)
+    std::vector<uint8_t> stage;          // a drain that straddles the wrap, stitched together
+
+    std::vector<uint8_t> ring;
+    size_t mask = 0;
+    alignas(64) std::atomic<size_t> head{0};   // writer thread
+    alignas(64) std::atomic<size_t> tail{0};   // mux thread
+    std::atomic<bool> eof{false};
+    std::mutex mu;
+    std::condition_variable data_cv, space_cv;
+    std::thread writer;
+
+    // mux thread
+    uint64_t chunks = 0, dropped = 0, dropped_bytes = 0, blocked = 0;
+    int64_t blocked_us = 0;
+    size_t fill_peak = 0;
+    double fill_sum = 0.0;
+    // writer thread
+    uint64_t bytes = 0, errors = 0;
+    LatencyStats write_lat;              // hist / n / max_us only: one sample per drain
+
+    ~AsyncOutput() {                     // early exits; async_output_close() is the normal path
+        if (!writer.joinable()) return;
+        eof = true;
+        data_cv.notify_all();
+        writer.join();
+    }
+};
+
+// AVIOContext write callback (mux thread).
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+static int async_output_write(void* opaque, const uint8_t* buf, int size) {
+#else
+static int async_output_write(void* opaque, uint8_t* buf, int size) {
+#endif
+    AsyncOutput& a = *(AsyncOutput*)opaque;
+    const size_t cap = a.ring.size(), n = (size_t)size;
+    const size_t t = a.tail.load(std::memory_order_relaxed);
+    size_t used = t - a.head.load(std::memory_order_acquire);
+    ++a.chunks;
+    if (cap - used < n) {
+        if (a.drop) {
+            ++a.dropped;
+            a.dropped_bytes += n;
+            return size;                 // the muxer carries on as if written
+        }
+        ++a.blocked;
+        const int64_t t0 = av_gettime_relative();
+        std::unique_lock<std::mutex> lk(a.mu);
+        while (cap - (used = t - a.head.load(std::memory_order_acquire)) < n)
+            a.space_cv.wait_for(lk, std::chrono::milliseconds(2));
+        a.blocked_us += av_gettime_relative() - t0;
+    }
+    const size_t off = t & a.mask, first = std::min(n, cap - off);
+    std::memcpy(a.ring.data() + off, buf, first);
+    std::memcpy(a.ring.data(), buf + first, n - first);
+    a.tail.store(t + n, std::memory_order_release);
+    used += n;
+    a.fill_peak = std::max(a.fill_peak, used);
+    a.fill_sum += (double)used;
+    a.data_cv.notify_one();
+    return size;
+}
+
+static void async_output_thread(AsyncOutput* a) {
+    const size_t cap = a->ring.size();
+    for (;;) {
+        const bool eof = a->eof.load();  // before tail: once set, the tail read below is final
+        const size_t h = a->head.load(std::memory_order_relaxed);
+        const size_t t = a->tail.load(std::memory_order_acquire);
+        size_t n = std::min(t - h, a->stage.size());
+        if (!eof) n -= n % a->unit;      // the tail end goes out with the trailer
+        if (n == 0) {
+            if (eof) break;
+            std::unique_lock<std::mutex> lk(a->mu);
+            a->data_cv.wait_for(lk, std::chrono::milliseconds(2));
+            continue;
+        }
+        const size_t off = h & a->mask;
+        const uint8_t* src = a->ring.data() + off;
+        if (n > cap - off) {
+            std::memcpy(a->stage.data(), src, cap - off);
+            std::memcpy(a->stage.data() + (cap - off), a->ring.data(), n - (cap - off));
+            src = a->stage.data();
+        }
+        const int64_t t0 = av_gettime_relative();
+        avio_write(a->inner, src, (int)n);
+        if (a->flush) avio_flush(a->inner);
+        const int64_t us = av_gettime_relative() - t0;
+        if (a->inner->error < 0) { ++a->errors; a->inner->error = 0; }
+        else a->bytes += n;
+        LatencyStats& ls = a->write_lat;
+        ++ls.hist[(size_t)std::min<int64_t>(us / 100, (int64_t)ls.hist.size() - 1)];
+        ls.max_us = std::max(ls.max_us, us);
+        ++ls.n;
+        a->head.store(h + n, std::memory_order_release);
+        a->space_cv.notify_one();
+    }
+}
+
+// Wraps ofmt->pb (already open) behind the ring; ring_kb is rounded up to a power of two.
+static bool async_output_open(AsyncOutput& a, AVFormatContext* ofmt, int ring_kb, bool drop) {
+    size_t cap = 64 * 1024;
+    while (cap < (size_t)ring_kb * 1024) cap <<= 1;
+    a.ring.assign(cap, 0);
+    a.mask = cap - 1;
+    a.drop = drop;
+    a.flush = ofmt->pb->max_packet_size <= 0;
+    a.unit = a.flush ? 188 : 7 * 188;
+    a.stage.assign(7 * 188 * 32, 0);
+    uint8_t* buf = (uint8_t*)av_malloc(AsyncOutput::kChunk);
+    a.pb = buf ? avio_alloc_context(buf, AsyncOutput::kChunk, 1, &a, nullptr, async_output_write, nullptr) : nullptr;
+    if (!a.pb) { av_free(buf); return false; }
+    a.write_lat.enabled = true;
+    a.inner = ofmt->pb;
+    ofmt->pb = a.pb;
+    ofmt->flags |= AVFMT_FLAG_CUSTOM_IO;
+    a.writer = std::thread(async_output_thread, &a);
+    return true;
+}
+
+// After av_write_trailer: drain the ring, report, close the real output.
+static void async_output_close(AsyncOutput& a) {
+    if (!a.pb) return;
+    avio_flush(a.pb);
+    if (a.writer.joinable()) {
+        a.eof = true;
+        a.data_cv.notify_all();
+        a.writer.join();
+    }
+    const LatencyStats& ls = a.write_lat;
+    std::cerr << "[out] ring " << a.ring.size() / 1024 << " KiB (" << (a.drop ? "drop" : "block") << "): fill avg="
+              << (a.chunks ? a.fill_sum / a.chunks / 1024 : 0.0) << " KiB peak=" << a.fill_peak / 1024
+              << " KiB; writes=" << ls.n << " p50=" << latency_percentile_ms(ls, 0.50) << "ms p99="
+              << latency_percentile_ms(ls, 0.99) << "ms max=" << ls.max_us / 1000.0 << "ms, errors=" << a.errors
+              << "; mux blocked " << a.blocked << "x for " << a.blocked_us / 1000 << " ms, dropped "
+              << a.dropped << " chunks (" << a.dropped_bytes << " bytes)\n";
+    av_freep(&a.pb->buffer);
+    avio_context_free(&a.pb);
+    avio_closep(&a.inner);
+}
+
+// ======================================================================================
+// Main
+// ======================================================================================
+
+int main(int argc, char** argv)
+{
+    const int64_t t_start = av_gettime_relative();
+    av_log_set_level(AV_LOG_ERROR);
+
+    // Defaults so `./cc_injector` runs without args
+    const char* defaultIn  = "udp://127.0.0.1:5000?timeout=5000000&fifo_size=1000000&overrun_nonfatal=1";
+    const char* defaultOut = "output.ts";
+
+    const char* inUrl  = (argc > 1) ? argv[1] : defaultIn;
+    const char* outUrl = (argc > 2) ? argv[2] : defaultOut;
+
+    // Flags
+    bool use_external_udp_captions = false;
+    std::vector<std::pair<std::string,uint16_t>> cc_primaries, cc_backups;
+    int failover_ms = 500;
+    int cc_rcvbuf = 0;   // SO_RCVBUF for caption sockets (0 = kernel default)
+
+    // Defaults: prefer libx264 (SEI/GA94 path), bootstrap on, linger 750ms
+    std::string venc_name = "libx264";
+    int bootstrap_enable = 1;
+    int linger_ms = 750;
+    int cc_refresh = 1;      // re-send mode + PAC + bottom row at every GOP start
+    int seg_row_ms = 1500;   // row spacing for segments without an end time
+    int video_delay_ms = 0;  // hold decoded video this long so late captions can air on time
+    int vad_silence_ms = 0;  // erase captions after this much silence (0 = off)
+    std::string preset_name = "medium";   // libx264/libx265 preset (starting point when adaptive)
+    int dec_threads = 0;     // video decoder threads (0 = FFmpeg default; libx265 runs get a quarter of the cores)
+    int x265_pools = 0;      // libx265 worker threads (0 = cores left after decode/convert/deinterlace)
+    std::string warm_cache;  // encoder parameters from the last run; enables the parallel warm start
+    int adaptive_preset = 0;
+    int rt_margin_pct = 20;  // encode-time headroom kept below the frame interval
+    std::string latency_mode = "normal";
+    int maxrate_kbps = 0;    // VBV rate for --latency=low / --muxrate_kbps (0 = derive)
+    int muxrate_kbps = 0;    // CBR TS with null stuffing (0 = VBR mux)
+    int pcr_ms = 20;         // PCR interval in CBR mode
+    int udp_pace = 1;        // CBR udp:// outputs: release 7x188-byte datagrams on a clock
+    int udp_batch = 1;       // udp:// datagrams per syscall (sendmmsg / GSO)
+    int out_ring_kb = 0;     // main output written by its own thread through this ring (0 = inline)
+    std::string out_ring_overflow = "block";
+    int bframes = 0;
+    int verify_cc = 0;       // decode our own output and check cc_data per picture
+    std::string ladder_heights;              // e.g. "720,540": extra renditions
+    std::string out_pix_fmt = "auto";        // encoder pixel format (auto: 8-bit 4:2:0)
+    int pixconv_threads = (int)std::min(4u, std::max(1u, std::thread::hardware_concurrency()));
+    int bench_pixconv = 0;                   // frames; >0 runs the conversion benchmark and exits
+    std::string field_mode = "progressive";  // progressive|interlaced (mbaff, paff)|deinterlace
+    std::string deint_filter = "bwdif";      // yadif|bwdif
+    int deint_threads = (int)std::min(4u, std::max(1u, std::thread::hardware_concurrency()));
+    std::string ladder_out = "rung_%d.ts";
+    std::vector<std::string> tee_specs;      // extra destinations for the main encode
+    int tee_queue = 512;                     // packets buffered per tee before it drops
+    std::string hls_dir;                     // LL-HLS output directory (empty = off)
+    int hls_seg_ms = 2000, hls_part_ms = 333, hls_list_size = 6;
+    int hls_blocking_reload = 0;   // the origin serving --hls implements blocking playlist reload
+    int ladder_sws_threads = 0;              // 0 = one per core
+    int vad_threshold_db = -45;
+    std::string audio_tap_name;   // shm name for the STT audio tap (empty = off)
+    int audio_tap_sec = 30;
+    bool use_mcast_captions = false;
+    std::string mcast_group; uint16_t mcast_port = 0;
+    std::string mcast_channels = "0";
+    std::string mcast_iface;
+    std::string plugin_path, plugin_args;
+    bool use_stdin_captions = false;
+    std::string cc_fifo_path;
+    int mcast_threads = 2;
+
+    for (int i = 1; i < argc; ++i) {
+        if (std::strncmp(argv[i], "--cc-udp=", 9) == 0 || std::strncmp(argv[i], "--cc-udp-backup=", 16) == 0) {
+            std::string cc_host; uint16_t cc_port = 0;
+            if (!parse_cc_udp_arg(argv[i], cc_host, cc_port)) {
+                std::cerr << "Invalid --cc-udp format. Use --cc-udp=HOST:PORT (e.g. --cc-udp=127.0.0.1:54001)\n";
+                return 1;
+            }
+            (argv[i][8] == '=' ? cc_primaries : cc_backups).emplace_back(cc_host, cc_port);
+            use_external_udp_captions = true;
+        } else if (parse_str_arg(argv[i], "--latency", latency_mode)) {
+            // parsed
+        } else if (parse_str_arg(argv[i], "--out_pix_fmt", out_pix_fmt)) {
+            // parsed
+        } else if (parse_int_arg(argv[i], "--pixconv_threads", pixconv_threads)) {
+            // parsed
+        } else if (parse_int_arg(argv[i], "--bench_pixconv", bench_pixconv)) {
+            // parsed
+        } else if (parse_int_arg(argv[i], "--dec_threads", dec_threads)) {
+            // parsed
+        } else if (parse_int_arg(argv[i], "--x265_pools", x265_pools)) {
+            // parsed
+        } else if (parse_str_arg(argv[i], "--warm_cache", warm_cache)) {
+            // parsed
+        } else if (parse_str_arg(argv[i], "--field_mode", field_mode)) {
+            // parsed
+        } else if (parse_str_arg(argv[i], "--deint", deint_filter)) {
+            // parsed
+        } else if (parse_int_arg(argv[i], "--deint_threads", deint_threads)) {
+            // parsed
+        } else if (std::strncmp(argv[i], "--tee=", 6) == 0) {
+            tee_specs.emplace_back(argv[i] + 6);
+        } else if (parse_int_arg(argv[i], "--tee_queue", tee_queue)) {
+            // parsed
+        } else if (parse_str_arg(argv[i], "--hls", hls_dir)) {
+            // parsed
+        } else if (parse_int_arg(argv[i], "--hls_seg_ms", hls_seg_ms)) {
+            // parsed
+        } else if (parse_int_arg(argv[i], "--hls_part_ms", hls_part_ms)) {
+            // parsed
+        } else if (parse_int_arg(argv[i], "--hls_list_size", hls_list_size)) {
+            // parsed
+        } else if (parse_int_arg(argv[i], "--hls_blocking_reload", hls_blocking_reload)) {
+            // parsed
+        } else if (parse_str_arg(argv[i], "--ladder", ladder_heights)) {
+            // parsed
+        } else if (parse_str_arg(argv[i], "--ladder_out", ladder_out)) {
+            // parsed
+        } else if (parse_int_arg(argv[i], "--ladder_sws_threads", ladder_sws_threads)) {
+            // parsed
+        } else if (parse_int_arg(argv[i], "--bframes", bframes)) {
+            // parsed
+        } else if (parse_int_arg(argv[i], "--verify_cc", verify_cc)) {
+            // parsed
+        } else if (parse_int_arg(argv[i], "--maxrate_kbps", maxrate_kbps)) {
+            // parsed
+        } else if (parse_int_arg(argv[i], "--muxrate_kbps", muxrate_kbps)) {
+            // parsed
+        } else if (parse_int_arg(argv[i], "--pcr_ms", pcr_ms)) {
+            // parsed
+        } else if (parse_int_arg(argv[i], "--udp_pace", udp_pace)) {
+            // parsed
+        } else if (parse_int_arg(argv[i], "--udp_batch", udp_batch)) {
+            // parsed
+        } else if (parse_int_arg(argv[i], "--out_ring_kb", out_ring_kb)) {
+            // parsed
+        } else if (parse_str_arg(argv[i], "--out_ring_overflow", out_ring_overflow)) {
+            if (out_ring_overflow != "block" && out_ring_overflow != "drop") {
+                std::cerr << "Invalid --out_ring_overflow: " << out_ring_overflow << " (block|drop)\n"; return 1;
+            }
+        } else if (parse_str_arg(argv[i], "--preset", preset_name)) {
+            // parsed
+        } else if (parse_int_arg(argv[i], "--adaptive_preset", adaptive_preset)) {
+            // parsed
+        } else if (parse_int_arg(argv[i], "--rt_margin_pct", rt_margin_pct)) {
+            // parsed
+        } else if (parse_int_arg(argv[i], "--vad_silence_ms", vad_silence_ms)) {
+            // parsed
+        } else if (parse_int_arg(argv[i], "--vad_threshold_db", vad_threshold_db)) {
+            // parsed
+        } else if (parse_int_arg(argv[i], "--video_delay_ms", video_delay_ms)) {
+            // parsed
+        } else if (parse_int_arg(argv[i], "--cc-rcvbuf", cc_rcvbuf)) {
+            // parsed
+        } else if (parse_int_arg(argv[i], "--cc-failover_ms", failover_ms)) {
+            // parsed
+        } else if (std::strncmp(argv[i], "--venc=", 7) == 0) {
             parse_venc_arg(argv[i], venc_name);
         } else if (parse_int_arg(argv[i], "--bootstrap", bootstrap_enable)) {
             // parsed
         } else if (parse_int_arg(argv[i], "--linger_ms", linger_ms)) {
             // parsed
+        } else if (parse_int_arg(argv[i], "--cc_refresh", cc_refresh)) {
+            // parsed
+        } else if (parse_int_arg(argv[i], "--seg_row_ms", seg_row_ms)) {
+            // parsed
+        } else if (parse_str_arg(argv[i], "--audio_tap", audio_tap_name)) {
+            if (!audio_tap_name.empty() && audio_tap_name[0] != '/') audio_tap_name.insert(0, "/");
+        } else if (parse_int_arg(argv[i], "--audio_tap_sec", audio_tap_sec)) {
+            // parsed
+        } else if (std::strncmp(argv[i], "--cc-mcast=", 11) == 0) {
+            if (!parse_cc_udp_arg(argv[i], mcast_group, mcast_port)) {
+                std::cerr << "Invalid --cc-mcast format. Use --cc-mcast=GROUP:PORT (e.g. --cc-mcast=239.10.10.10:54010)\n";
+                return 1;
+            }
+            use_mcast_captions = true;
+        } else if (parse_str_arg(argv[i], "--cc-channel", mcast_channels)) {
+            // parsed
+        } else if (std::strcmp(argv[i], "--cc-stdin") == 0) {
+            use_stdin_captions = true;
+        } else if (parse_str_arg(argv[i], "--cc-fifo", cc_fifo_path)) {
+            // parsed
+        } else if (parse_str_arg(argv[i], "--cc-plugin", plugin_path)) {
+            // parsed
+        } else if (parse_str_arg(argv[i], "--cc-plugin-args", plugin_args)) {
+            // parsed
+        } else if (parse_str_arg(argv[i], "--cc-iface", mcast_iface)) {
+            // parsed
+        } else if (parse_int_arg(argv[i], "--cc-ingest-threads", mcast_threads)) {
+            // parsed
         }
     }
 
+    if (bench_pixconv > 0) return pixconv_bench(bench_pixconv, pixconv_threads);
+
+    if (latency_mode != "normal" && latency_mode != "low") {
+        std::cerr << "Unknown --latency mode: " << latency_mode << " (normal|low)\n"; return 1;
+    }
+    const bool low_latency = (latency_mode == "low");
+    if (field_mode == "paff") {
+        std::cerr << "[field] libx264 has no PAFF (field pictures); coding interlaced input as MBAFF\n";
+        field_mode = "interlaced";
+    } else if (field_mode == "mbaff") {
+        field_mode = "interlaced";
+    }
+    if (field_mode != "progressive" && field_mode != "interlaced" && field_mode != "deinterlace") {
+        std::cerr << "Unknown --field_mode: " << field_mode << " (progressive|interlaced|mbaff|paff|deinterlace)\n"; return 1;
+    }
+    if (deint_filter != "yadif" && deint_filter != "bwdif") {
+        std::cerr << "Unknown --deint filter: " << deint_filter << " (yadif|bwdif)\n"; return 1;
+    }
+    if (low_latency && video_delay_ms > 0)
+        std::cerr << "[lat] --video_delay_ms adds " << video_delay_ms << " ms on top of the low-latency path\n";
+
+    // Encoder + output open in parallel with probing the input
+    WarmStart warm{};
+    if (!warm_cache.empty()) warm_start_begin(warm, warm_cache, outUrl);
+
     // Open input
     AVFormatContext* ifmt = nullptr;
-    if (avformat_open_input(&ifmt, inUrl, nullptr, nullptr) < 0) {
+    AVDictionary* in_opts = nullptr;
+    if (low_latency) av_dict_set(&in_opts, "fflags", "nobuffer", 0);
+    int in_ret = avformat_open_input(&ifmt, inUrl, nullptr, &in_opts);
+    av_dict_free(&in_opts);
+    if (in_ret < 0) {
         std::cerr << "open input failed: " << inUrl << "\n"; return 1;
     }
+    startup_mark(t_start, "input open");
     if (avformat_find_stream_info(ifmt, nullptr) < 0) {
         std::cerr << "find_stream_info failed\n"; return 1;
     }
+    startup_mark(t_start, "stream info");
 
     int vIdx = av_find_best_stream(ifmt, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
     int aIdx = av_find_best_stream(ifmt, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
@@ -322,8 +4247,27 @@ int main(int argc, char** argv)
     if (!vdec) { std::cerr << "video decoder not found\n"; return 1; }
     AVCodecContext* vdecCtx = avcodec_alloc_context3(vdec);
     avcodec_parameters_to_context(vdecCtx, ifmt->streams[vIdx]->codecpar);
+    if (low_latency) {
+        // Frame threading holds one frame per thread; slice threads return each frame at once
+        vdecCtx->flags |= AV_CODEC_FLAG_LOW_DELAY;
+        vdecCtx->thread_type = FF_THREAD_SLICE;
+    }
+    // libx265 wants most of the machine: give the decoder a fixed share so the two don't fight
+    const int hw_threads = (int)std::max(1u, std::thread::hardware_concurrency());
+    if (dec_threads > 0) vdecCtx->thread_count = dec_threads;
+    else if (venc_name == "libx265") vdecCtx->thread_count = std::max(1, hw_threads / 4);
     if (avcodec_open2(vdecCtx, vdec, nullptr) < 0) { std::cerr << "open vdec failed\n"; return 1; }
 
+    // Scan type from the first decoded pictures (their packets are replayed by the main loop)
+    std::deque<AVPacket*> replay;
+    AVFieldOrder src_fields = AV_FIELD_PROGRESSIVE;
+    if (field_mode != "progressive") {
+        src_fields = field_probe_input(ifmt, vIdx, vdecCtx, replay);
+        std::cerr << "[field] source is " << field_order_name(src_fields) << "\n";
+    }
+    const bool src_interlaced = src_fields == AV_FIELD_TT || src_fields == AV_FIELD_BB;
+    startup_mark(t_start, "decoder open");
+
     // Choose video encoder
     const AVCodec* venc = nullptr;
     if (!venc_name.empty())
@@ -335,32 +4279,111 @@ int main(int argc, char** argv)
         } else if (venc_name == "mpeg2video") {
             venc = avcodec_find_encoder(AV_CODEC_ID_MPEG2VIDEO);
             if (!venc) { std::cerr << "MPEG-2 encoder not found\n"; return 1; }
+        } else if (venc_name == "libx265") {
+            // No fallback to another HEVC encoder: pools, presets and a53cc are libx265 options
+            std::cerr << "libx265 encoder not found (FFmpeg built without --enable-libx265)\n"; return 1;
         } else {
             std::cerr << "Unknown encoder: " << venc_name << "\n";
             return 1;
         }
     }
 
-    AVCodecContext* vencCtx = avcodec_alloc_context3(venc);
     AVRational in_rate = ifmt->streams[vIdx]->r_frame_rate.num ? ifmt->streams[vIdx]->r_frame_rate
                                                                : av_make_q(30,1);
+    const bool is_x264 = std::strcmp(venc->name, "libx264") == 0;
+    const bool is_x265 = std::strcmp(venc->name, "libx265") == 0;
+    VencConfig vcfg{};
+    vcfg.low_latency = low_latency;
+    vcfg.bframes = bframes;
+    bool want_deint = field_mode == "deinterlace";
+    if (field_mode == "interlaced" && src_interlaced) {
+        if (is_x264 || venc->id == AV_CODEC_ID_MPEG2VIDEO) {
+            vcfg.field_order = src_fields;
+            std::cerr << "[field] coding " << field_order_name(src_fields) << (is_x264 ? " (MBAFF)" : " (field DCT/ME)") << "\n";
+        } else {
+            std::cerr << "[field] " << venc->name << " cannot code interlaced pictures; deinterlacing instead\n";
+            want_deint = true;
+        }
+    }
 
-    vencCtx->width   = vdecCtx->width  ? vdecCtx->width  : 1280;
-    vencCtx->height  = vdecCtx->height ? vdecCtx->height : 720;
-    vencCtx->pix_fmt = vdecCtx->pix_fmt == AV_PIX_FMT_NONE ? AV_PIX_FMT_YUV420P : (AVPixelFormat)vdecCtx->pix_fmt;
-    vencCtx->time_base = av_inv_q(in_rate);
-    vencCtx->framerate = in_rate;
-    vencCtx->gop_size  = 30;
-    vencCtx->max_b_frames = 0;
-
-    // Encourage A/53 captions in libx26x wrappers (no-op if option absent)
-    av_opt_set(vencCtx->priv_data, "a53cc", "1", 0);
+    // Delivery pixel format: 8-bit 4:2:0 sources pass through, anything else is converted
+    const AVPixelFormat src_pix = vdecCtx->pix_fmt;
+    AVPixelFormat enc_pix = src_pix;
+    if (out_pix_fmt != "auto") {
+        enc_pix = av_get_pix_fmt(out_pix_fmt.c_str());
+        if (enc_pix == AV_PIX_FMT_NONE) { std::cerr << "Unknown --out_pix_fmt: " << out_pix_fmt << "\n"; return 1; }
+    } else if (src_pix != AV_PIX_FMT_NONE && src_pix != AV_PIX_FMT_YUV420P && src_pix != AV_PIX_FMT_YUVJ420P) {
+        enc_pix = AV_PIX_FMT_YUV420P;
+    }
+    vcfg.pix_fmt = enc_pix;
+    PixConv pixconv{};
+    if (src_pix != AV_PIX_FMT_NONE && enc_pix != src_pix) {
+        if (!pixconv_init(pixconv, vdecCtx->width, vdecCtx->height, src_pix, enc_pix, pixconv_threads, false, in_rate)) {
+            std::cerr << "[pixconv] cannot convert " << av_get_pix_fmt_name(src_pix) << " -> " << av_get_pix_fmt_name(enc_pix) << "\n";
+            return 1;
+        }
+        std::cerr << "[pixconv] " << av_get_pix_fmt_name(src_pix) << " -> " << av_get_pix_fmt_name(enc_pix)
+                  << (pixconv.custom ? " with the SIMD kernel, " + std::to_string(pixconv.nslices) + " slice(s)"
+                                     : std::string(" with swscale")) << "\n";
+    }
+    if (low_latency && bframes > 0)
+        std::cerr << "[lat] --bframes ignored: the low-latency profile encodes without reordering\n";
+    if (low_latency) {
+        // Default VBV rate: ~0.12 bit per pixel (about 7.5 Mbit/s for 1080p30)
+        double fps = av_q2d(in_rate);
+        vcfg.maxrate = maxrate_kbps > 0 ? (int64_t)maxrate_kbps * 1000
+                                        : (int64_t)(0.12 * std::max(vdecCtx->width, 1) * std::max(vdecCtx->height, 1) * fps);
+    }
+    if (muxrate_kbps > 0) {
+        // CBR mux: video must fit under the mux rate with room for audio, PES/TS headers and PSI
+        const int64_t cap = (int64_t)muxrate_kbps * 800;
+        if (maxrate_kbps > 0) vcfg.maxrate = (int64_t)maxrate_kbps * 1000;
+        else                  vcfg.maxrate = vcfg.maxrate > 0 ? std::min(vcfg.maxrate, cap) : cap;
+        if (vcfg.maxrate > cap)
+            std::cerr << "[cbr] video maxrate " << vcfg.maxrate / 1000 << " kbit/s is above 80% of the mux rate; "
+                         "the muxer may run out of room\n";
+    }
+    PresetController prc{};
+    if (is_x264 || is_x265) {
+        // libx265 uses the same preset names, so the controller drives either
+        int idx = x264_preset_index(preset_name);
+        if (idx < 0) { std::cerr << "Unknown " << venc->name << " preset: " << preset_name << "\n"; return 1; }
+        vcfg.preset = preset_name;
+        // A preset swap changes the SPS/PPS (profile, entropy coder, reference count). MPEG-TS
+        // carries them in-band, but fMP4 and other global-header containers keep the first ones.
+        if (adaptive_preset) {
+            bool fixed_headers = !hls_dir.empty();
+            for (const std::string& spec : tee_specs) fixed_headers = fixed_headers || tee_spec_global_header(spec);
+            if (fixed_headers) {
+                std::cerr << "--adaptive_preset cannot be combined with --hls or a --tee whose container stores "
+                             "codec headers once (mp4, mov, mkv, flv): a preset change rewrites the SPS/PPS\n";
+                return 1;
+            }
+            preset_ctl_init(prc, idx, in_rate, rt_margin_pct);
+        }
+    } else if (adaptive_preset) {
+        std::cerr << "[rc] --adaptive_preset needs libx264 or libx265; ignored for " << venc->name << "\n";
+    }
+    if (is_x265) {
+        // Cores not already spoken for by decode, pixel conversion and deinterlacing
+        int busy = std::max(1, vdecCtx->thread_count) + (pixconv.enabled ? pixconv.nslices : 0) + (want_deint ? deint_threads : 0);
+        vcfg.threads = x265_pools > 0 ? x265_pools : std::max(1, hw_threads - busy);
+        std::cerr << "[venc] libx265: pools=" << vcfg.threads << " of " << hw_threads << " hardware threads (decoder "
+                  << vdecCtx->thread_count << ")\n";
+    }
 
-    if (avcodec_open2(vencCtx, venc, nullptr) < 0) { std::cerr << "open venc failed\n"; return 1; }
+    // Size is pinned so the configuration (and the warm cache) fully describes the encoder
+    vcfg.width = vdecCtx->width;
+    vcfg.height = vdecCtx->height;
+    AVCodecContext* vencCtx = warm.enabled ? warm_start_take_encoder(warm, venc->name, vcfg, in_rate) : nullptr;
+    const bool venc_warm = vencCtx != nullptr;
+    if (!vencCtx) vencCtx = open_video_encoder(venc, vdecCtx, in_rate, vcfg);
+    if (!vencCtx) { std::cerr << "open venc failed\n"; return 1; }
+    startup_mark(t_start, venc_warm ? "encoder ready (warm)" : "encoder ready");
 
     // Output muxer (MPEG-TS)
-    AVFormatContext* ofmt = nullptr;
-    if (avformat_alloc_output_context2(&ofmt, nullptr, "mpegts", outUrl) < 0 || !ofmt) {
+    AVFormatContext* ofmt = warm.enabled ? warm_start_take_output(warm) : nullptr;
+    if (!ofmt && (avformat_alloc_output_context2(&ofmt, nullptr, "mpegts", outUrl) < 0 || !ofmt)) {
         std::cerr << "alloc output failed\n"; return 1;
     }
     AVStream* vout = avformat_new_stream(ofmt, venc);
@@ -412,10 +4435,156 @@ int main(int argc, char** argv)
         }
     }
 
-    if (!(ofmt->oformat->flags & AVFMT_NOFILE)) {
+    UdpPacer pacer;
+    const bool paced_udp = muxrate_kbps > 0 && udp_pace;
+    if ((paced_udp || udp_batch > 1) && std::strncmp(outUrl, "udp://", 6) == 0) {
+        if (!udp_pacer_open(pacer, outUrl, paced_udp ? (int64_t)muxrate_kbps * 1000 : 0, udp_batch)) {
+            std::cerr << "open output failed: " << outUrl << " (this UDP writer takes udp://IPV4:PORT)\n"; return 1;
+        }
+        ofmt->pb = pacer.pb;
+        ofmt->flags |= AVFMT_FLAG_CUSTOM_IO;
+        std::cerr << "[udp] " << (paced_udp ? "paced" : "unpaced") << " output " << outUrl << ": " << pacer.cap
+                  << " datagram ring, " << pacer.prebuffer << " before the first release, batches of " << pacer.batch
+                  << (pacer.batch == 1 ? " (send)" : pacer.gso ? " (GSO)" : " (sendmmsg)") << "\n";
+    }
+    if (!(ofmt->oformat->flags & AVFMT_NOFILE) && !ofmt->pb) {
         if (avio_open(&ofmt->pb, outUrl, AVIO_FLAG_WRITE) < 0) { std::cerr << "open output failed: " << outUrl << "\n"; return 1; }
     }
-    if (avformat_write_header(ofmt, nullptr) < 0) { std::cerr << "write header failed\n"; return 1; }
+    // The paced UDP writer already has its own ring and sender thread
+    AsyncOutput out_ring;
+    if (out_ring_kb > 0 && ofmt->pb && !(ofmt->flags & AVFMT_FLAG_CUSTOM_IO)) {
+        if (!async_output_open(out_ring, ofmt, out_ring_kb, out_ring_overflow == "drop")) {
+            std::cerr << "[out] could not set up the output ring\n"; return 1;
+        }
+        std::cerr << "[out] " << outUrl << " written by its own thread through a " << out_ring.ring.size() / 1024
+                  << " KiB ring (" << out_ring_overflow << " when full)\n";
+    }
+    AVDictionary* mux_opts = nullptr;
+    if (muxrate_kbps > 0) {
+        // Null stuffing up to the rate; PCRs from byte position every pcr_ms (ISO 13818-1: <= 100 ms)
+        av_dict_set_int(&mux_opts, "muxrate", (int64_t)muxrate_kbps * 1000, 0);
+        av_dict_set_int(&mux_opts, "pcr_period", std::min(std::max(pcr_ms, 1), 100), 0);
+        std::cerr << "[cbr] muxrate " << muxrate_kbps << " kbit/s, PCR every " << std::min(std::max(pcr_ms, 1), 100)
+                  << " ms, video capped at " << vcfg.maxrate / 1000 << " kbit/s\n";
+    }
+    if (low_latency) {
+        ofmt->flags |= AVFMT_FLAG_FLUSH_PACKETS;                      // avio_flush after every packet
+        ofmt->max_interleave_delta = av_rescale_q(1, av_inv_q(in_rate), AVRational{1, AV_TIME_BASE});
+        av_dict_set(&mux_opts, "pes_payload_size", "0", 0);           // no audio PES aggregation
+    }
+    int hdr_ret = avformat_write_header(ofmt, &mux_opts);
+    av_dict_free(&mux_opts);
+    if (hdr_ret < 0) { std::cerr << "write header failed\n"; return 1; }
+    startup_mark(t_start, "output header");
+    if (warm.enabled) warm_cache_save(warm.path, venc->name, vcfg, in_rate);
+
+    // Deinterlace stage between conversion and the delay line / encoder
+    Deinterlacer deint{};
+    if (want_deint) {
+        if (!deint_init(deint, deint_filter, vencCtx->width, vencCtx->height, vencCtx->pix_fmt, vencCtx->time_base,
+                        vdecCtx->sample_aspect_ratio, in_rate, deint_threads)) {
+            std::cerr << "[field] cannot build the " << deint_filter << " filter graph\n";
+            return 1;
+        }
+        std::cerr << "[field] deinterlacing with " << deint_filter << ", " << deint_threads << " slice thread(s)"
+                  << (src_interlaced ? "" : " (source probed progressive; interlaced pictures only)") << "\n";
+    }
+
+    // cc_data side data buffers (CC_DATA_MAX bytes each, reused every frame)
+    AVBufferPool* cc_pool = av_buffer_pool_init(CC_DATA_MAX, av_buffer_alloc);
+    if (!cc_pool) { std::cerr << "Could not allocate the cc_data buffer pool\n"; return 1; }
+
+    // Nothing below may return early: tee, HLS and ladder threads are running from here on
+    // Tee outputs: same packets, other containers/protocols, one writer thread each
+    std::vector<std::unique_ptr<TeeOutput>> tees;
+    for (const std::string& spec : tee_specs) {
+        std::unique_ptr<TeeOutput> t(new TeeOutput());
+        t->spec = spec;
+        if (!tee_parse_spec(*t)) {
+            std::cerr << "Invalid --tee: " << spec << " (use [f=FMT:opt=val]URL)\n";
+            tee_close(tees);
+            return 1;
+        }
+        if (!tee_open(*t, vout, aout, low_latency, (size_t)std::max(tee_queue, 8))) {
+            std::cerr << "[tee] could not open " << t->url << "\n";
+            tees.push_back(std::move(t));
+            tee_close(tees);
+            return 1;
+        }
+        std::cerr << "[tee] " << t->url << " (" << t->ofmt->oformat->name << ")\n";
+        t->writer = std::thread(tee_writer, t.get());
+        tees.push_back(std::move(t));
+    }
+    if (!hls_dir.empty()) {
+        // The segmenter is one more tee: its writer thread muxes fMP4 and publishes the files
+        std::unique_ptr<TeeOutput> t(new TeeOutput());
+        t->spec = t->url = hls_dir;
+        t->hls.reset(new HlsWriter());
+        HlsWriter& h = *t->hls;
+        const double fps = av_q2d(in_rate);
+        h.dir = hls_dir;
+        h.rate = in_rate;
+        h.frame_us = (int64_t)(1e6 / fps);
+        h.part_us = std::max<int64_t>((int64_t)hls_part_ms * 1000, h.frame_us);
+        h.seg_us = std::max<int64_t>((int64_t)hls_seg_ms * 1000, h.part_us);
+        h.list_size = std::max(hls_list_size, 2);
+        h.blocking_reload = hls_blocking_reload != 0;
+        // A segment ends on the first IDR at or after the target, so it can run up to a GOP over
+        h.target_s = (int)std::ceil(h.seg_us / 1e6 + vencCtx->gop_size / fps);
+        h.width = vencCtx->width;
+        h.height = vencCtx->height;
+        h.has_audio = aout != nullptr;
+        if (venc->id != AV_CODEC_ID_H264 && venc->id != AV_CODEC_ID_HEVC)
+            std::cerr << "[hls] " << venc->name << " in fMP4 is not playable by HLS clients; use libx264 or libx265\n";
+        if (!tee_open(*t, vout, aout, low_latency, (size_t)std::max(tee_queue, 8))) {
+            std::cerr << "[hls] could not start the segmenter in " << hls_dir << "\n";
+            tees.push_back(std::move(t));
+            tee_close(tees);
+            return 1;
+        }
+        std::cerr << "[hls] " << hls_dir << ": " << h.seg_us / 1000 << "ms segments, " << h.part_us / 1000
+                  << "ms parts, " << h.list_size << " in the playlist\n";
+        t->writer = std::thread(tee_writer, t.get());
+        tees.push_back(std::move(t));
+    }
+
+    // ABR ladder: extra renditions of the same captioned pictures
+    std::vector<std::unique_ptr<LadderRung>> ladder;
+    if (!ladder_heights.empty() && vcfg.field_order != AV_FIELD_PROGRESSIVE)
+        std::cerr << "[ladder] rungs are coded progressive from interlaced pictures; --field_mode=deinterlace avoids combing\n";
+    for (size_t p = 0; p < ladder_heights.size(); ) {
+        size_t comma = ladder_heights.find(',', p);
+        int h = std::atoi(ladder_heights.substr(p, comma == std::string::npos ? std::string::npos : comma - p).c_str());
+        if (h >= 2) {
+            std::unique_ptr<LadderRung> r(new LadderRung());
+            r->height = h & ~1;
+            r->url = ladder_rung_url(ladder_out, r->height);
+            if (ladder_rung_open(*r, venc, vdecCtx, vencCtx->pix_fmt, vcfg, in_rate, aencCtx, aout, low_latency, ladder_sws_threads)) {
+                r->worker = std::thread(ladder_worker, r.get());
+                std::cerr << "[ladder] " << r->width << "x" << r->height << " -> " << r->url << "\n";
+                ladder.push_back(std::move(r));
+            } else {
+                std::cerr << "[ladder] cannot open " << h << "p rendition at " << r->url << "; skipped\n";
+                std::vector<std::unique_ptr<LadderRung>> failed;
+                failed.push_back(std::move(r));
+                ladder_close(failed);
+            }
+        }
+        if (comma == std::string::npos) break;
+        p = comma + 1;
+    }
+
+    CcVerifier ccv{};
+    if (verify_cc && !cc_verify_open(ccv, vencCtx)) {
+        std::cerr << "[verify] cannot open a " << avcodec_get_name(vencCtx->codec_id) << " decoder; check disabled\n";
+    }
+
+    LatencyStats lat{};
+    lat.enabled = low_latency;
+    lat.frame_ms = 1000.0 / av_q2d(in_rate);
+    if (low_latency)
+        std::cerr << "[lat] low-latency profile: zerolatency, sliced threads, intra refresh, VBV "
+                  << vcfg.maxrate / 1000 << " kbit/s x 1 frame\n";
 
     AVPacket* ipkt = av_packet_alloc();
     AVPacket* opkt = av_packet_alloc();
@@ -424,34 +4593,347 @@ int main(int argc, char** argv)
 
     // Caption state
     const bool USE_ROLLUP = true;
-    RollUp2State ru2{};
-    bool caption_pending = false;
-    std::string current_caption;
+    CaptionScheduler ccs{};
+    ccs.use_rollup = USE_ROLLUP;
+    cc_sched_init(ccs, vencCtx->time_base, in_rate, seg_row_ms);
+    const int64_t linger_ticks = av_rescale_q(linger_ms, AVRational{1,1000}, vencCtx->time_base);
+    int64_t sched_pts = 0;    // last PTS seen (stands in when a frame has none)
 
-    // NEW: track last two distinct captions to avoid duplicate lines in RU2
-    std::string prev_caption;  // top line (previous)
-    std::string curr_caption;  // bottom line (current)
+    // Voice activity from decoded audio clears roll-up captions after silence
+    AudioVad vad{};
+    vad_init(vad, vad_silence_ms, vad_threshold_db, vencCtx->time_base);
+    if (vad.enabled && !adecCtx) {
+        std::cerr << "[vad] no decodable audio; caption clearing disabled\n";
+        vad.enabled = false;
+    }
 
-    // Linger last caption so player can latch on
-    std::string last_caption;
-    int64_t last_caption_expire_pts = AV_NOPTS_VALUE;
+    // Optional fixed video delay (audio follows via vdelay.audio)
+    FrameDelay vdelay{};
+    if (video_delay_ms > 0 &&
+        !frame_delay_init(vdelay, video_delay_ms, vencCtx->width, vencCtx->height, vencCtx->pix_fmt,
+                          vencCtx->time_base, in_rate))
+        std::cerr << "[delay] could not preallocate " << video_delay_ms << " ms of frames; running without delay\n";
 
     // Bootstrap caption (helps players expose CC track immediately)
     bool bootstrap_pending = (bootstrap_enable != 0);
     std::string bootstrap_caption = "CC ONLINE";
-    int64_t bootstrap_expire_pts = AV_NOPTS_VALUE;
+    std::vector<CaptionSegment> segs;
+    CcData cc;
+    AllocCheck allocs{};
+
+    // Multicast ingest: this program consumes the listed channel IDs from the shared group
+    McastIngest mcast{};
+    if (use_mcast_captions) {
+        std::vector<int> chans;
+        for (size_t p = 0; p <= mcast_channels.size(); ) {
+            size_t comma = mcast_channels.find(',', p);
+            std::string tok = mcast_channels.substr(p, comma == std::string::npos ? std::string::npos : comma - p);
+            if (!tok.empty()) chans.push_back(std::atoi(tok.c_str()));
+            if (comma == std::string::npos) break;
+            p = comma + 1;
+        }
+        mcast.iface = mcast_iface;
+        mcast.rcvbuf = cc_rcvbuf;
+        if (chans.empty() || !mcast_ingest_start(mcast, mcast_group, mcast_port, chans, mcast_threads)) {
+            std::cerr << "Failed to start multicast caption ingest; continuing without it.\n";
+            use_mcast_captions = false;
+        }
+    }
+
+    // stdin / named-pipe line sources
+    LineIngest stdin_in{}, fifo_in{};
+    if (use_stdin_captions && !line_ingest_start(stdin_in, ""))
+        std::cerr << "Failed to read captions from stdin; continuing without it.\n";
+    if (!cc_fifo_path.empty() && !line_ingest_start(fifo_in, cc_fifo_path))
+        std::cerr << "Failed to open caption FIFO " << cc_fifo_path << ": " << std::strerror(errno) << "\n";
 
-    // External UDP listener
-    CaptionInput caprx{};
+    // In-process caption source plugin
+    CaptionPlugin plugin{};
+    if (!plugin_path.empty() && !cc_plugin_load(plugin, plugin_path, plugin_args))
+        std::cerr << "Failed to load caption plugin; continuing without it.\n";
+
+    // Audio tap for a local STT consumer
+    AudioTap tap{};
+    if (!audio_tap_name.empty()) {
+        if (!adecCtx) std::cerr << "[tap] no decodable audio; tap disabled\n";
+        else if (!audio_tap_open(tap, audio_tap_name, audio_tap_sec))
+            std::cerr << "[tap] shm_open " << audio_tap_name << " failed: " << std::strerror(errno) << "\n";
+    }
+
+    // External UDP listeners (primaries first, then backups)
+    RedundantInputs capin{};
+    capin.failover_us = (int64_t)std::max(0, failover_ms) * 1000;
     if (use_external_udp_captions) {
-        if (!open_udp_listener(caprx, cc_host, cc_port)) {
-            std::cerr << "Failed to open UDP caption listener; continuing without external captions.\n";
+        for (int pass = 0; pass < 2; ++pass) {
+            for (const auto& hp : (pass == 0 ? cc_primaries : cc_backups)) {
+                CaptionSource src{};
+                src.backup = (pass == 1);
+                if (!open_udp_listener(src.in, hp.first, hp.second, cc_rcvbuf)) {
+                    std::cerr << "Failed to open UDP caption listener " << hp.first << ":" << hp.second << "; skipping it.\n";
+                    continue;
+                }
+                capin.sources.push_back(std::move(src));
+            }
+        }
+        if (capin.sources.empty()) {
+            std::cerr << "No UDP caption listener; continuing without external captions.\n";
             use_external_udp_captions = false;
         }
     }
 
-    while (av_read_frame(ifmt, ipkt) >= 0) {
+    uint64_t pixconv_dropped = 0;
+
+    // Everything the video encoder has ready -> mux
+    // DTS must keep rising across an encoder swap even though a new encoder with a longer B-frame
+    // delay starts its DTS behind the old one's last packet. The first packet of each new chain
+    // fixes one offset for the whole chain (PTS and DTS alike), the smallest that keeps both
+    // DTS and PTS after everything already muxed; the encoder's own DTS pattern is kept.
+    int64_t venc_frames = 0;     // frames sent to the current encoder chain (GOP counting)
+    int64_t last_vdts = AV_NOPTS_VALUE, max_vpts = AV_NOPTS_VALUE;
+    int64_t vts_offset = 0;      // vout time base, applied to the current encoder chain
+    bool vchain_start = false;   // next packet muxed is a new encoder's first
+    uint64_t vts_shifts = 0;
+    EncoderDrain vdrain;                 // a replaced encoder still flushing (preset swaps)
+    EncoderOpen vopen;                   // the next preset's encoder while it opens
+    std::vector<AVPacket*> vheld;        // the new encoder's packets while vdrain runs
+    vheld.reserve(64);
+    EncodeStats encst{};
+    encst.frame_ms = 1000.0 / av_q2d(in_rate);
+    int64_t first_cc_pts = AV_NOPTS_VALUE;   // first picture sent with cc_data (startup log)
+    bool first_pkt_logged = false, first_cc_logged = false;
+    // One encoded packet (time base tb) -> main output and tees; unrefs pkt
+    auto mux_video_packet = [&](AVPacket* pkt, AVRational tb) {
+        const int64_t enc_pts = pkt->pts;
+        encst.bytes += pkt->size;
+        const bool captioned = !first_cc_logged && first_cc_pts != AV_NOPTS_VALUE && enc_pts == first_cc_pts;
+        cc_verify_packet(ccv, pkt);
+        av_packet_rescale_ts(pkt, tb, vout->time_base);
+        pkt->stream_index = vout->index;
+        if (vchain_start && pkt->dts != AV_NOPTS_VALUE && pkt->pts != AV_NOPTS_VALUE && last_vdts != AV_NOPTS_VALUE) {
+            const int64_t prev = vts_offset;
+            vts_offset = std::max<int64_t>(0, last_vdts + 1 - pkt->dts);
+            if (max_vpts != AV_NOPTS_VALUE) vts_offset = std::max(vts_offset, max_vpts + 1 - pkt->pts);
+            if (vts_offset != prev) {
+                ++vts_shifts;
+                std::cerr << "[venc] new encoder's timestamps offset by "
+                          << av_rescale_q(vts_offset, vout->time_base, AVRational{1, 1000}) << " ms to keep DTS rising\n";
+            }
+        }
+        vchain_start = false;
+        if (pkt->pts != AV_NOPTS_VALUE) { pkt->pts += vts_offset; max_vpts = std::max(max_vpts, pkt->pts); }
+        if (pkt->dts != AV_NOPTS_VALUE) { pkt->dts += vts_offset; last_vdts = pkt->dts; }
+        if (!tees.empty()) tee_submit(tees, pkt, true);
+        av_interleaved_write_frame(ofmt, pkt);
+        av_packet_unref(pkt);
+        if (!first_pkt_logged) { first_pkt_logged = true; startup_mark(t_start, "first video packet"); }
+        if (captioned) { first_cc_logged = true; startup_mark(t_start, "first captioned picture"); }
+        if (lat.enabled) {
+            latency_note_output(lat, enc_pts, av_gettime_relative());
+            if (lat.n && lat.n % 600 == 0) latency_report(lat, "running");
+        }
+    };
+
+    // A replaced encoder's packets, then the new encoder's held ones. Without wait, only once
+    // the drain thread is done; returns false while it is still running.
+    auto finish_encoder_drain = [&](bool wait) -> bool {
+        if (!vdrain.ctx) return true;
+        if (!wait && !vdrain.done) return false;
+        vdrain.worker.join();
+        for (AVPacket*& p : vdrain.pkts) { mux_video_packet(p, vdrain.ctx->time_base); av_packet_free(&p); }
+        vdrain.pkts.clear();
+        avcodec_free_context(&vdrain.ctx);
+        vchain_start = true;
+        for (AVPacket*& p : vheld) { mux_video_packet(p, vencCtx->time_base); av_packet_free(&p); }
+        vheld.clear();
+        return true;
+    };
+
+    auto write_video_packets = [&]() {
+        const bool draining = !finish_encoder_drain(false);
+        while (avcodec_receive_packet(vencCtx, opkt) == 0) {
+            if (!draining) { mux_video_packet(opkt, vencCtx->time_base); continue; }
+            AVPacket* held = av_packet_alloc();
+            if (held) { av_packet_move_ref(held, opkt); vheld.push_back(held); }
+            else av_packet_unref(opkt);
+        }
+    };
+
+    // Encoded audio (aout time base) -> main output, every tee and every ladder rung
+    auto write_audio_packet = [&](AVPacket* p) {
+        if (!ladder.empty()) ladder_submit_audio(ladder, p);
+        if (!tees.empty()) tee_submit(tees, p, false);
+        av_interleaved_write_frame(ofmt, p);
+    };
+
+    // Captions + encode + mux for one picture leaving the delay line (or straight from the
+    // decoder when there is no delay). Caption "now" is this picture's PTS, i.e. the output edge.
+    bool venc_swapped = false;
+    auto emit_video_frame = [&](AVFrame* f) -> bool {
+        if (f->pts != AV_NOPTS_VALUE) sched_pts = f->pts;
+        else                          ++sched_pts;
+
+        // Bootstrap immediately at start (lingers ~1s)
+        if (bootstrap_pending) {
+            bootstrap_pending = false;
+            CaptionSegment boot; boot.text = bootstrap_caption;
+            cc_sched_push_segment(ccs, boot, sched_pts, cc_sched_sec_to_pts(ccs, 1.0));
+        }
+
+        // Poll UDP (non-blocking) and queue every segment
+        if (use_external_udp_captions) {
+            segs.clear();
+            redundant_poll(capin, av_gettime_relative(), segs);
+            for (const CaptionSegment& seg : segs)
+                cc_sched_push_segment(ccs, seg, sched_pts, linger_ticks);
+        }
+        for (LineIngest* li : { &stdin_in, &fifo_in }) {
+            if (li->fd < 0) continue;
+            segs.clear();
+            if (!line_ingest_drain(*li, segs)) continue;
+            for (const CaptionSegment& seg : segs) {
+                std::cerr << "[cc] " << li->label << ": \"" << seg.text << "\"\n";
+                cc_sched_push_segment(ccs, seg, sched_pts, linger_ticks);
+            }
+        }
+        if (plugin.started) {
+            segs.clear();
+            if (cc_plugin_drain(plugin, segs)) {
+                for (const CaptionSegment& seg : segs) {
+                    std::cerr << "[cc] plugin: \"" << seg.text << "\"\n";
+                    cc_sched_push_segment(ccs, seg, sched_pts, linger_ticks);
+                }
+            }
+        }
+        if (use_mcast_captions) {
+            for (size_t slot = 0; slot < mcast.channels.size(); ++slot) {
+                segs.clear();
+                if (!mcast_ingest_drain(mcast, (int)slot, segs)) continue;
+                for (const CaptionSegment& seg : segs) {
+                    if (seg.text.empty()) continue;
+                    std::cerr << "[cc] recv ch=" << seg.channel << ": \"" << seg.text << "\"\n";
+                    cc_sched_push_segment(ccs, seg, sched_pts, linger_ticks);
+                }
+            }
+        }
+
+        // Remove any previous A/53 on this frame
+        av_frame_remove_side_data(f, AV_FRAME_DATA_A53_CC);
+
+        if (vad.enabled && vad_silent_at(vad, sched_pts))
+            cc_sched_erase_if_idle(ccs, sched_pts, vad.silence_ticks);
+
+        // GOP start: pin the keyframe here so the refresh lands on it. Under --latency=low the
+        // intra-refresh wave completes on the same cadence, so that recovery point is used as is,
+        // unless --hls needs a real IDR to start each segment.
+        if (venc_frames % vencCtx->gop_size == 0) {
+            if ((cc_refresh && !low_latency) || !hls_dir.empty()) f->pict_type = AV_PICTURE_TYPE_I;
+            if (cc_refresh) cc_sched_request_refresh(ccs);
+        }
+
+        // -------------------- Build CC buffer within the 608 budget --------------------
+        cc_sched_build_frame(ccs, sched_pts, cc);
+
+        cc_verify_expect(ccv, f->pts, cc);
+        if (cc.size && first_cc_pts == AV_NOPTS_VALUE) first_cc_pts = f->pts;
+
+        // Attach CC side-data (pooled buffer)
+        if (!attach_cc_side_data(f, cc_pool, cc))
+            std::cerr << "[cc] could not attach " << cc.size << " cc bytes at pts=" << f->pts << "\n";
+        if (!ladder.empty()) ladder_submit_frame(ladder, f);
+
+        // Preset changes happen between GOPs: the controller's pick is opened on a helper thread,
+        // and at a later boundary the old encoder drains on another while the new one continues
+        // from an IDR on this picture
+        if (prc.enabled && venc_frames > 0 && venc_frames % vencCtx->gop_size == 0) {
+            if (vopen.worker.joinable()) {
+                if (vopen.done) {
+                    vopen.worker.join();
+                    if (vopen.ctx) {
+                        venc_swapped = true;
+                        finish_encoder_drain(true);      // the previous swap's, long done by now
+                        write_video_packets();
+                        encoder_drain_start(vdrain, vencCtx);
+                        vencCtx = vopen.ctx;
+                        vopen.ctx = nullptr;
+                        vcfg = vopen.cfg;
+                        f->pict_type = AV_PICTURE_TYPE_I;   // the new encoder starts on an IDR here
+                    } else {
+                        std::cerr << "[rc] could not open preset " << vopen.cfg.preset << "; staying on " << vcfg.preset << "\n";
+                        prc.idx = x264_preset_index(vcfg.preset);
+                    }
+                }
+            } else {
+                int next = preset_ctl_decide(prc, av_gettime_relative());
+                if (next >= 0) {
+                    VencConfig ncfg = vcfg;
+                    ncfg.preset = kX264Presets[next];
+                    ncfg.width = vencCtx->width;
+                    ncfg.height = vencCtx->height;
+                    ncfg.pix_fmt = vencCtx->pix_fmt;
+                    encoder_open_start(vopen, venc, in_rate, ncfg);
+                }
+            }
+        }
+
+        // Encode -> mux
+        int64_t enc_t0 = av_gettime_relative();
+        if (avcodec_send_frame(vencCtx, f) < 0) return false;
+        write_video_packets();
+        const int64_t enc_us = av_gettime_relative() - enc_t0;
+        if (prc.enabled) preset_ctl_sample(prc, enc_us);
+        enc_stats_frame(encst, enc_us);
+        if (encst.frames % 1800 == 0) enc_stats_report(encst, venc->name, vcfg.preset, "running");
+        ++venc_frames;
+        // Release the audio that belongs before this picture
+        while (!vdelay.audio.empty() &&
+               (f->pts == AV_NOPTS_VALUE ||
+                av_compare_ts(vdelay.audio.front()->pts, aout->time_base, f->pts, vencCtx->time_base) <= 0)) {
+            write_audio_packet(vdelay.audio.front());
+            frame_delay_release_audio(vdelay);
+        }
+        return true;
+    };
+
+    // Steady-state allocation check around every emitted picture (counts only with CC_ALLOC_DEBUG)
+    auto emit_video = [&](AVFrame* f) -> bool {
+        const uint64_t a0 = cc_alloc_count(), seg0 = ccs.segments;
+        venc_swapped = vdrain.ctx != nullptr;   // packets held while an old encoder drains
+        bool ok = emit_video_frame(f);
+        alloc_check_frame(allocs, cc_alloc_count() - a0, venc_swapped || ccs.segments != seg0);
+        return ok;
+    };
+
+    // Decoded picture -> delay line or straight to captions/encode; unrefs pic
+    auto deliver_video = [&](AVFrame* pic) -> bool {
+        if (!vdelay.enabled) {
+            bool ok = emit_video(pic);
+            av_frame_unref(pic);
+            return ok;
+        }
+        if (frame_delay_full(vdelay)) {
+            ++vdelay.forced;
+            emit_video(frame_delay_pop(vdelay, true));
+        }
+        if (!frame_delay_push(vdelay, pic)) std::cerr << "[delay] frame copy failed; frame dropped\n";
+        av_frame_unref(pic);
+        while (AVFrame* out = frame_delay_pop(vdelay, false)) emit_video(out);
+        return true;
+    };
+
+    // Packets held back by the field probe go first
+    auto read_input = [&](AVPacket* pkt) -> bool {
+        if (replay.empty()) return av_read_frame(ifmt, pkt) >= 0;
+        av_packet_move_ref(pkt, replay.front());
+        av_packet_free(&replay.front());
+        replay.pop_front();
+        return true;
+    };
+
+    while (read_input(ipkt)) {
         if (ipkt->stream_index == vIdx) {
+            if (lat.enabled && ipkt->pts != AV_NOPTS_VALUE)
+                latency_note_input(lat, av_rescale_q(ipkt->pts, ifmt->streams[vIdx]->time_base, vencCtx->time_base),
+                                   av_gettime_relative());
             if (avcodec_send_packet(vdecCtx, ipkt) == 0) {
                 while (avcodec_receive_frame(vdecCtx, vfrm) == 0) {
                     // Rescale PTS to encoder tb
@@ -460,120 +4942,56 @@ int main(int argc, char** argv)
                     if (vfrm->pts != AV_NOPTS_VALUE)
                         vfrm->pts = av_rescale_q(vfrm->pts, src, dst);
 
-                    // Poll UDP (non-blocking) and log
-                    if (use_external_udp_captions && caprx.enabled) {
-                        std::string latest;
-                        if (udp_get_latest_line_and_log(caprx.fd, latest)) {
-                            if (!latest.empty()) {
-                                current_caption = latest;
-                                caption_pending = true;
-
-                                // (Re)set linger
-                                int64_t linger = (int64_t)((linger_ms / 1000.0) * (vencCtx->time_base.den / (double)vencCtx->time_base.num));
-                                last_caption = current_caption;
-                                last_caption_expire_pts = (vfrm->pts == AV_NOPTS_VALUE) ? linger : vfrm->pts + linger;
-                            }
-                        }
-                    }
-
-                    // Bootstrap immediately at start (for ~1s)
-                    if (bootstrap_pending) {
-                        int64_t linger = (int64_t)(1.0 * vencCtx->time_base.den / (double)vencCtx->time_base.num);
-                        bootstrap_expire_pts = (vfrm->pts == AV_NOPTS_VALUE) ? linger : vfrm->pts + linger;
-                        bootstrap_pending = false;
-
-                        last_caption = bootstrap_caption;
-                        last_caption_expire_pts = bootstrap_expire_pts;
-                        current_caption = bootstrap_caption;
-                        caption_pending = true; // force immediate injection
-                    } else if (bootstrap_enable &&
-                               vfrm->pts != AV_NOPTS_VALUE &&
-                               vfrm->pts < bootstrap_expire_pts &&
-                               !caption_pending) {
-                        current_caption = bootstrap_caption;
-                        caption_pending = true; // keep bootstrap alive during window
-                    }
-
-                    // Remove any previous A/53 on this frame
-                    av_frame_remove_side_data(vfrm, AV_FRAME_DATA_A53_CC);
-
-                    // -------------------- Build CC buffer with "distinct-roll" logic --------------------
-                    std::vector<uint8_t> cc;
-                    bool do_inject      = false;
-                    bool do_repaint     = false;  // repaint bottom w/o CR
-                    bool do_roll        = false;  // roll (CR), then paint bottom
-
-                    // NEW UDP/bootstrap line just arrived
-                    if (caption_pending && !current_caption.empty()) {
-                        caption_pending = false; // consume the event
-
-                        // First-time bootstrap: if nothing on screen yet, paint bottom only
-                        if (!ru2.started && curr_caption.empty()) {
-                            curr_caption = current_caption;
-                            do_repaint   = true;   // RU2 (once) + PAC + text
-                            do_inject    = true;
-                        } else {
-                            // Only roll when the new line is DISTINCT from the current bottom line
-                            if (current_caption != curr_caption) {
-                                prev_caption = curr_caption;     // becomes top after CR
-                                curr_caption = current_caption;  // becomes bottom after CR
-                                do_roll   = true;                // send CR + new text
-                                do_inject = true;
-                            } else {
-                                // Same text as bottom: repaint only (avoid duplicates on both rows)
-                                do_repaint = true;
-                                do_inject  = true;
-                            }
-                        }
-                    }
-                    // Linger window: repaint only (no CR)
-                    else if (!curr_caption.empty() &&
-                             vfrm->pts != AV_NOPTS_VALUE &&
-                             vfrm->pts < last_caption_expire_pts) {
-                        current_caption = curr_caption; // reaffirm bottom text
-                        do_repaint  = true;
-                        do_inject   = true;
-                    }
-
-                    if (do_inject) {
-                        if (USE_ROLLUP) {
-                            if (do_roll)      build_ru2_update_cc(cc, ru2, current_caption);     // includes CR
-                            else              build_ru2_repaint_no_roll(cc, ru2, current_caption);
-                        } else {
-                            build_popon_cc(cc, current_caption);
-                        }
-                    }
-
-                    // Attach CC side-data (and log)
-                    if (!cc.empty()) {
-                        AVFrameSideData* sd = av_frame_new_side_data(vfrm, AV_FRAME_DATA_A53_CC, cc.size());
-                        if (sd) {
-                            std::memcpy(sd->data, cc.data(), cc.size());
-                            std::cerr << "[cc] inject len=" << cc.size()
-                                      << (do_roll ? " (roll)" : " (repaint)")
-                                      << " pts=" << vfrm->pts << "\n";
+                    // Delivery format conversion (pooled output, valid until the next frame)
+                    AVFrame* pic = vfrm;
+                    if (pixconv.enabled) {
+                        pic = pixconv_run(pixconv, vfrm);
+                        av_frame_unref(vfrm);
+                        if (!pic) {
+                            if (!pixconv_dropped++) std::cerr << "[pixconv] picture does not match the converter (size/format change?); dropping\n";
+                            continue;
                         }
                     }
 
-                    // Encode -> mux
-                    if (avcodec_send_frame(vencCtx, vfrm) < 0) break;
-                    while (avcodec_receive_packet(vencCtx, opkt) == 0) {
-                        av_packet_rescale_ts(opkt, vencCtx->time_base, vout->time_base);
-                        opkt->stream_index = vout->index;
-                        av_interleaved_write_frame(ofmt, opkt);
-                        av_packet_unref(opkt);
+                    if (!deint.enabled) {
+                        if (!deliver_video(pic)) break;
+                        continue;
                     }
-                    av_frame_unref(vfrm);
+                    deint_push(deint, pic);
+                    av_frame_unref(pic);
+                    bool ok = true;
+                    while (ok && (pic = deint_pull(deint))) ok = deliver_video(pic);
+                    if (!ok) break;
                 }
             }
-        } else if (aIdx >= 0 && ipkt->stream_index == aIdx && adecCtx && aencCtx && aout) {
+        } else if (aIdx >= 0 && ipkt->stream_index == aIdx && adecCtx &&
+                   ((aencCtx && aout) || tap.enabled || cc_plugin_wants_audio(plugin) || vad.enabled)) {
             if (avcodec_send_packet(adecCtx, ipkt) == 0) {
                 while (avcodec_receive_frame(adecCtx, afrm) == 0) {
+                    if (vad.enabled) {
+                        AVRational atb = ifmt->streams[aIdx]->time_base;
+                        int64_t vpts = afrm->pts == AV_NOPTS_VALUE ? AV_NOPTS_VALUE
+                                                                   : av_rescale_q(afrm->pts, atb, vencCtx->time_base);
+                        int64_t vdur = afrm->sample_rate > 0
+                            ? av_rescale_q(afrm->nb_samples, AVRational{1, afrm->sample_rate}, vencCtx->time_base) : 0;
+                        vad_feed(vad, afrm, vpts, vdur);
+                    }
+                    if (tap.enabled || cc_plugin_wants_audio(plugin)) {
+                        int64_t tap_pts_us = AV_NOPTS_VALUE;
+                        int n = audio_tap_resample(tap, afrm, ifmt->streams[aIdx]->time_base, tap_pts_us);
+                        if (n > 0) {
+                            audio_tap_publish(tap, n, tap_pts_us);
+                            if (cc_plugin_wants_audio(plugin))
+                                plugin.api->on_audio(plugin.inst, tap.scratch.data(), n, AUDIO_TAP_RATE, tap_pts_us);
+                        }
+                    }
+                    if (!aencCtx || !aout) { av_frame_unref(afrm); continue; }
                     if (avcodec_send_frame(aencCtx, afrm) < 0) break;
                     while (avcodec_receive_packet(aencCtx, opkt) == 0) {
                         av_packet_rescale_ts(opkt, aencCtx->time_base, aout->time_base);
                         opkt->stream_index = aout->index;
-                        av_interleaved_write_frame(ofmt, opkt);
+                        if (vdelay.enabled && frame_delay_hold_audio(vdelay, opkt)) continue;
+                        write_audio_packet(opkt);
                         av_packet_unref(opkt);
                     }
                     av_frame_unref(afrm);
@@ -583,40 +5001,73 @@ int main(int argc, char** argv)
         av_packet_unref(ipkt);
     }
 
-    // Flush video
-    avcodec_send_frame(vencCtx, nullptr);
-    while (avcodec_receive_packet(vencCtx, opkt) == 0) {
-        av_packet_rescale_ts(opkt, vencCtx->time_base, vout->time_base);
-        opkt->stream_index = vout->index;
-        av_interleaved_write_frame(ofmt, opkt);
-        av_packet_unref(opkt);
+    // Flush the deinterlacer, drain the delay line, then flush video
+    if (deint.enabled && deint_push(deint, nullptr)) {
+        while (AVFrame* pic = deint_pull(deint)) deliver_video(pic);
     }
-    // Flush audio
+    while (AVFrame* out = frame_delay_pop(vdelay, true)) emit_video(out);
+    finish_encoder_drain(true);
+    avcodec_send_frame(vencCtx, nullptr);
+    write_video_packets();
+    // Flush audio (anything still held for the delay line goes first)
+    for (AVPacket*& p : vdelay.audio) { write_audio_packet(p); av_packet_free(&p); }
+    vdelay.audio.clear();
     if (aencCtx && aout) {
         avcodec_send_frame(aencCtx, nullptr);
         while (avcodec_receive_packet(aencCtx, opkt) == 0) {
             av_packet_rescale_ts(opkt, aencCtx->time_base, aout->time_base);
             opkt->stream_index = aout->index;
-            av_interleaved_write_frame(ofmt, opkt);
+            write_audio_packet(opkt);
             av_packet_unref(opkt);
         }
     }
 
     av_write_trailer(ofmt);
+    async_output_close(out_ring);
+    udp_pacer_close(pacer);
+    tee_close(tees);
+    ladder_close(ladder);
 
     // cleanup
+    frame_delay_free(vdelay);
+    pixconv_close(pixconv);
+    deint_close(deint);
+    warm_start_close(warm);
+    for (AVPacket*& p : replay) av_packet_free(&p);
+    av_buffer_pool_uninit(&cc_pool);
+    if (pixconv_dropped) std::cerr << "[pixconv] dropped " << pixconv_dropped << " picture(s)\n";
     av_frame_free(&vfrm); av_frame_free(&afrm);
     av_packet_free(&ipkt); av_packet_free(&opkt);
     if (adecCtx) avcodec_free_context(&adecCtx);
     if (aencCtx) avcodec_free_context(&aencCtx);
     avcodec_free_context(&vdecCtx);
     avcodec_free_context(&vencCtx);
-    if (!(ofmt->oformat->flags & AVFMT_NOFILE)) avio_closep(&ofmt->pb);
+    if (!(ofmt->flags & AVFMT_FLAG_CUSTOM_IO) && !(ofmt->oformat->flags & AVFMT_NOFILE)) avio_closep(&ofmt->pb);
     avformat_free_context(ofmt);
     avformat_close_input(&ifmt);
 
     // close UDP
-    if (caprx.fd >= 0) close(caprx.fd);
+    for (CaptionSource& src : capin.sources) {
+        if (capin.sources.size() > 1)
+            std::cerr << "[cc] source " << src.in.host << ":" << src.in.port << (src.backup ? " (backup)" : " (primary)")
+                      << " aired=" << src.aired << " dupes=" << src.dupes << "\n";
+        log_rx_stats(src.in.label, src.in.stats);
+        if (src.in.fd >= 0) close(src.in.fd);
+    }
+    mcast_ingest_stop(mcast);
+    cc_plugin_unload(plugin);
+    line_ingest_stop(stdin_in);
+    line_ingest_stop(fifo_in);
+    audio_tap_close(tap);
+    vad_report(vad);
+    cc_verify_close(ccv);
+    if (vts_shifts) std::cerr << "[venc] timestamp offset changed at " << vts_shifts << " encoder swap(s)\n";
+    latency_report(lat, "final");
+    enc_stats_report(encst, venc->name, vcfg.preset, "final");
+    if (prc.enabled)
+        std::cerr << "[rc] final preset " << vcfg.preset << " after " << prc.changes << " change(s)\n";
+    cc_sched_report(ccs);
+    alloc_check_report(allocs);
 
     std::cout << "Done: " << outUrl << "\n";
     return 0;
@@ -0,0 +1,72 @@
+
+/* cc_plugin.h
+ * In-process caption source plugins for cc_injector (stable C ABI, loaded with dlopen).
+ *
+ * A plugin is a shared object exporting
+ *
+ *     const cc_plugin* cc_plugin_entry(uint32_t host_abi_version);
+ *
+ * The host calls create() with its callback table and the --cc-plugin-args string, then start().
+ * The plugin runs its own threads and hands captions to the injector with host->push_caption(),
+ * which copies the event into the caption scheduler's queue (no socket, no serialization).
+ * Plugins that want program audio (e.g. an embedded STT engine) set on_audio and receive the
+ * decoded input resampled to 16 kHz mono float, stamped with the input PTS in microseconds.
+ *
+ * ABI rules: fields are only ever appended. Events carry struct_size so either side can tell
+ * which fields the other was built with. Bump CC_PLUGIN_ABI_VERSION only for breaking changes.
+ *
+ * Build a plugin: gcc -shared -fPIC -O2 my_plugin.c -o my_plugin.so -pthread
+ */
+#ifndef CC_PLUGIN_H
+#define CC_PLUGIN_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CC_PLUGIN_ABI_VERSION 1
+#define CC_PLUGIN_ENTRY_SYMBOL "cc_plugin_entry"
+
+/* Caption priority lanes (same as "@pri=" on the wire) */
+#define CC_PRI_EMERGENCY 0
+#define CC_PRI_OPERATOR  1
+#define CC_PRI_NORMAL    2
+
+typedef struct cc_caption_event {
+    uint32_t    struct_size;  /* sizeof(cc_caption_event) as compiled by the plugin */
+    const char* text;         /* ASCII; host sanitizes and wraps into 32-column rows */
+    double      start_s;      /* stream seconds, <0: on arrival ("@t=" start) */
+    double      end_s;        /* stream seconds, <0: derive from row count ("@t=" end) */
+    double      dur_s;        /* seconds from arrival, <0: unused ("@d=") */
+    int32_t     priority;     /* CC_PRI_* */
+    int64_t     seq;          /* <0: unsequenced ("@seq=") */
+} cc_caption_event;
+
+typedef struct cc_plugin_host {
+    uint32_t abi_version;
+    void*    host_ctx;
+    /* Thread-safe, non-blocking. Returns 0 on success, -1 if the queue is full. */
+    int  (*push_caption)(void* host_ctx, const cc_caption_event* ev);
+    void (*log)(void* host_ctx, const char* msg);
+} cc_plugin_host;
+
+typedef struct cc_plugin {
+    uint32_t    abi_version;
+    const char* name;
+    void* (*create)(const cc_plugin_host* host, const char* args);   /* NULL on failure */
+    int   (*start)(void* inst);                                       /* 0 on success */
+    /* Optional. Called on the injector's decode thread; must not block. */
+    void  (*on_audio)(void* inst, const float* pcm, int nb_samples, int sample_rate, int64_t pts_us);
+    void  (*stop)(void* inst);
+    void  (*destroy)(void* inst);
+} cc_plugin;
+
+typedef const cc_plugin* (*cc_plugin_entry_fn)(uint32_t host_abi_version);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CC_PLUGIN_H */
@@ -0,0 +1,145 @@
+
+/* cc_plugin_replay.c
+ * Stub caption source plugin: replays a text file, one caption per line, for testing the
+ * in-process plugin path without an STT engine.
+ *
+ * Build: gcc -shared -fPIC -O2 cc_plugin_replay.c -o cc_plugin_replay.so -pthread
+ * Use:   ./cc_injector in.ts out.ts --cc-plugin=./cc_plugin_replay.so \
+ *            --cc-plugin-args=file=captions.txt,interval_ms=3000,loop=1
+ *
+ * Args (comma separated): file=PATH (required), interval_ms=N (default 3000, also each
+ * line's spread duration), loop=0|1 (default 1), priority=0..2 (default 2).
+ * Blank lines and lines starting with '#' are skipped.
+ */
+#include "cc_plugin.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct replay_state {
+    const cc_plugin_host* host;
+    char  path[1024];
+    int   interval_ms;
+    int   loop;
+    int   priority;
+    atomic_int running;         /* read by the plugin thread, cleared by the host in stop() */
+    pthread_t thread;
+} replay_state;
+
+static void replay_log(replay_state* st, const char* msg)
+{
+    if (st->host && st->host->log) st->host->log(st->host->host_ctx, msg);
+}
+
+static void parse_args(replay_state* st, const char* args)
+{
+    char buf[2048];
+    char* save = NULL;
+    char* tok;
+    if (!args) return;
+    snprintf(buf, sizeof(buf), "%s", args);
+    for (tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        if      (strncmp(tok, "file=", 5) == 0)        snprintf(st->path, sizeof(st->path), "%s", tok + 5);
+        else if (strncmp(tok, "interval_ms=", 12) == 0) st->interval_ms = atoi(tok + 12);
+        else if (strncmp(tok, "loop=", 5) == 0)        st->loop = atoi(tok + 5);
+        else if (strncmp(tok, "priority=", 9) == 0)    st->priority = atoi(tok + 9);
+    }
+}
+
+static void sleep_ms(int ms)
+{
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (long)(ms % 1000) * 1000000L;
+    nanosleep(&ts, NULL);
+}
+
+static void* replay_thread(void* arg)
+{
+    replay_state* st = (replay_state*)arg;
+    char line[2048];
+
+    do {
+        FILE* f = fopen(st->path, "r");
+        if (!f) { replay_log(st, "replay: cannot open file"); return NULL; }
+        while (atomic_load(&st->running) && fgets(line, sizeof(line), f)) {
+            size_t n = strcspn(line, "\r\n");
+            cc_caption_event ev;
+            line[n] = '\0';
+            if (n == 0 || line[0] == '#') continue;
+
+            memset(&ev, 0, sizeof(ev));
+            ev.struct_size = sizeof(ev);
+            ev.text = line;
+            ev.start_s = -1.0;
+            ev.end_s = -1.0;
+            ev.dur_s = st->interval_ms / 1000.0;
+            ev.priority = st->priority;
+            ev.seq = -1;
+            if (st->host->push_caption(st->host->host_ctx, &ev) != 0) replay_log(st, "replay: host queue full");
+
+            /* sleep in short steps so stop() returns promptly */
+            for (int slept = 0; atomic_load(&st->running) && slept < st->interval_ms; slept += 50) sleep_ms(50);
+        }
+        fclose(f);
+    } while (atomic_load(&st->running) && st->loop);
+    return NULL;
+}
+
+static void* replay_create(const cc_plugin_host* host, const char* args)
+{
+    replay_state* st = (replay_state*)calloc(1, sizeof(replay_state));
+    if (!st) return NULL;
+    st->host = host;
+    st->interval_ms = 3000;
+    st->loop = 1;
+    st->priority = CC_PRI_NORMAL;
+    parse_args(st, args);
+    if (!st->path[0] || st->interval_ms <= 0) {
+        replay_log(st, "replay: need file=PATH and interval_ms > 0");
+        free(st);
+        return NULL;
+    }
+    return st;
+}
+
+static int replay_start(void* inst)
+{
+    replay_state* st = (replay_state*)inst;
+    atomic_store(&st->running, 1);
+    if (pthread_create(&st->thread, NULL, replay_thread, st) != 0) { atomic_store(&st->running, 0); return -1; }
+    return 0;
+}
+
+static void replay_stop(void* inst)
+{
+    replay_state* st = (replay_state*)inst;
+    if (!atomic_load(&st->running)) return;
+    atomic_store(&st->running, 0);
+    pthread_join(st->thread, NULL);
+}
+
+static void replay_destroy(void* inst)
+{
+    free(inst);
+}
+
+static const cc_plugin replay_plugin = {
+    CC_PLUGIN_ABI_VERSION,
+    "replay",
+    replay_create,
+    replay_start,
+    NULL,               /* no audio needed */
+    replay_stop,
+    replay_destroy,
+};
+
+const cc_plugin* cc_plugin_entry(uint32_t host_abi_version)
+{
+    if (host_abi_version != CC_PLUGIN_ABI_VERSION) return NULL;
+    return &replay_plugin;
+}